@@ -32,9 +32,28 @@ int App::run()
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
         update(dt);
-        draw();
 
-        present();
+        // The pages requested by the last frames, before this one samples.
+        if (m_page_cache)
+        {
+            m_page_cache->update();
+        }
+
+        // Start this frame, then show the oldest frame in flight, which is
+        // this one when there is only one.
+        const size_t frame_count = m_frames.size();
+        Frame&       frame       = *m_frames[m_frame_idx % frame_count];
+        record(frame);
+        frame.done =
+            std::async(std::launch::async, [this, &frame] { draw(frame); });
+
+        if (m_frame_idx + 1 >= frame_count)
+        {
+            Frame& oldest = *m_frames[(m_frame_idx + 1) % frame_count];
+            oldest.done.get();
+            present(oldest);
+        }
+        ++m_frame_idx;
 
         glfwSwapBuffers(m_window);
         glfwPollEvents();
@@ -255,23 +274,34 @@ bool App::init(const Desc& desc)
     }
 
 
-    // Rasterizer init.
-    // Scene renderer.
-    if (!m_rasterizer.init(desc.rasterizer_desc))
-    {
-        return false;
-    }
-
-    // Light pass renderer.
+    // Rasterizer init, for every frame in flight.
     Rasterizer::Desc shadow_map_desc{};
-    shadow_map_desc.width      = k_shadow_map_size;
-    shadow_map_desc.height     = k_shadow_map_size;
-    shadow_map_desc.draw_color = false;
-    shadow_map_desc.draw_depth = true;
-    shadow_map_desc.cull_model = Rasterizer::CullMode::CounterClockWise;
-    if (!m_shadow_map.init(shadow_map_desc))
+    shadow_map_desc.width        = k_shadow_map_size;
+    shadow_map_desc.height       = k_shadow_map_size;
+    shadow_map_desc.draw_color   = false;
+    shadow_map_desc.draw_depth   = true;
+    shadow_map_desc.depth_format = DepthFormat::D16;
+    shadow_map_desc.tiled_layout = true;
+    shadow_map_desc.cull_model   = Rasterizer::CullMode::CounterClockWise;
+
+    m_sample_count = desc.rasterizer_desc.sample_count;
+    m_frames.resize(std::max(desc.frames_in_flight, 1));
+    for (auto& frame : m_frames)
     {
-        return false;
+        frame = std::make_unique<Frame>();
+
+        // Scene renderer.
+        if (!frame->rasterizer.init(desc.rasterizer_desc))
+        {
+            return false;
+        }
+
+        // Light pass renderer.
+        if (!frame->shadow_map.init(shadow_map_desc))
+        {
+            return false;
+        }
+        frame->fs_pcss.shadow_map = frame->shadow_map.getDepthView();
     }
 
 
@@ -302,21 +332,25 @@ bool App::init(const Desc& desc)
     m_scene["cube"] = Cube::create();  // The object that will cast the shadow.
 
 
-    // Shader init.
-    vs_light_pass = std::make_unique<VSShadow>();
-    fs_light_pass = std::make_unique<FSShadow>();
-
-    vs_mvp_with_light           = std::make_unique<VSMvpLight>();
-    fs_pcss                     = std::make_unique<FSShadowPCSS>();
-    fs_pcss->shadow_map_texture = m_shadow_map.getDepthBuffer().data();
-    fs_pcss->shadow_map_width   = k_shadow_map_size;
-    fs_pcss->shadow_map_height  = k_shadow_map_size;
+    // Texture streaming. The evicted pages are kept until the frames in
+    // flight are done.
+    if (desc.texture_budget > 0)
+    {
+        TexturePageCache::Desc page_cache_desc{};
+        page_cache_desc.budget       = desc.texture_budget;
+        page_cache_desc.retire_delay = int(m_frames.size());
+        m_page_cache = std::make_unique<TexturePageCache>(page_cache_desc);
+    }
 
-    vs_normal_mapping = std::make_unique<VSNormalMapping>();
+    // Shader init. The containers of the textures are written to the build
+    // tree.
+#ifdef TEXTURE_CONTAINER_DIR
+    Texture::setContainerDirectory(TEXTURE_CONTAINER_DIR);
+#endif
     fs_normal_mapping = std::make_unique<FSNormalMapping>(
         "../resources/brickwall.jpg",
-        "../resources/brickwall_normal.jpg");  // Normal mapping fs needs 2
-                                               // textures.
+        "../resources/brickwall_normal.jpg",
+        m_page_cache.get());  // Normal mapping fs needs 2 textures.
 
 
     return true;
@@ -324,6 +358,15 @@ bool App::init(const Desc& desc)
 
 void App::exit()
 {
+    // Finish the frames in flight.
+    for (auto& frame : m_frames)
+    {
+        if (frame->done.valid())
+        {
+            frame->done.wait();
+        }
+    }
+
     // Clear resources.
     glfwDestroyWindow(m_window);
     m_window = nullptr;
@@ -374,13 +417,13 @@ void App::update(float dt)
 
     // Other input handle.
     {
-        // Screen shot.
+        // Screen shot, of the next presented frame.
         if (GLFW_PRESS == glfwGetKey(m_window, GLFW_KEY_P))
         {
-            m_rasterizer.saveImage();
+            m_save_image = true;
         }
 
-        // Enable / disable 4xMsaa.
+        // Enable / disable msaa.
         {
             static int last_frame_key_m_state = 0;
             int        curr_state = glfwGetKey(m_window, GLFW_KEY_M);
@@ -388,9 +431,10 @@ void App::update(float dt)
             if (last_frame_key_m_state == GLFW_PRESS &&
                 curr_state == GLFW_RELEASE)
             {
-                static bool enable = true;
-                enable             = !enable;
-                m_rasterizer.setEnable4xMsaa(enable);
+                // Switch between the initial sample count and no msaa.
+                static const int msaa_sample_count =
+                    std::max(m_sample_count, 4);
+                m_sample_count = m_sample_count > 1 ? 1 : msaa_sample_count;
             }
 
             last_frame_key_m_state = curr_state;
@@ -422,76 +466,112 @@ void App::update(float dt)
     }
 }
 
-void App::draw()
+void App::record(Frame& frame)
 {
-    // Clear buffer.
-    m_shadow_map.clearDepthBuffer();
-
-    m_rasterizer.clearFrameBuffer();
-    m_rasterizer.clearDepthBuffer();
-
+    frame.rasterizer.setSampleCount(m_sample_count);
 
     // Prepare matrix data. Calculate here so that we don't need to calculate
     // mutiple times in one frame.
-    glm::mat4 camera_proj = m_render_camera->getProj();
-    glm::mat4 camera_view = m_render_camera->getView();
+    frame.camera_proj = m_render_camera->getProj();
+    frame.camera_view = m_render_camera->getView();
+    frame.camera_pos  = m_render_camera->getPosition();
+
+    frame.light_proj = m_light->getCamera()->getProj();
+    frame.light_view = m_light->getCamera()->getView();
+    frame.light_pos  = m_light->getPosition();
+
+    for (const auto& [name, primitive] : m_scene)
+    {
+        frame.models[name] = primitive->getModel();
+    }
+}
+
+void App::draw(Frame& frame)
+{
+    // Clear buffer.
+    frame.shadow_map.clearDepthBuffer();
 
-    glm::mat4 light_proj = m_light->getCamera()->getProj();
-    glm::mat4 light_view = m_light->getCamera()->getView();
+    frame.rasterizer.clearFrameBuffer();
+    frame.rasterizer.clearDepthBuffer();
 
 
-    // Draw shadow map.
+    // Draw shadow map, only the depth is needed.
     {
-        vs_light_pass->mat_light_proj = light_proj;
-        vs_light_pass->mat_light_view = light_view;
+        VSShadow& vs_light_pass = frame.vs_light_pass;
+
+        vs_light_pass.mat_light_proj = frame.light_proj;
+        vs_light_pass.mat_light_view = frame.light_view;
 
-        for (const auto& [_, primitive] : m_scene)
+        for (const auto& [name, primitive] : m_scene)
         {
-            vs_light_pass->mat_model = primitive->getModel();
+            vs_light_pass.mat_model = frame.models.at(name);
 
-            m_shadow_map.render(primitive->getVertices(),
-                                primitive->getIndices(),
-                                *vs_light_pass,
-                                *fs_light_pass);
+            frame.shadow_map.renderDepth(primitive->getVertices(),
+                                         primitive->getIndices(),
+                                         vs_light_pass.getDepthTransform());
         }
+
+        frame.shadow_map.resolve();
     }
 
 
     // Draw scene.
     {
         {
-            vs_mvp_with_light->mat_proj       = camera_proj;
-            vs_mvp_with_light->mat_view       = camera_view;
-            vs_mvp_with_light->mat_light_proj = light_proj;
-            vs_mvp_with_light->mat_light_view = light_view;
+            VSMvpLight& vs_mvp_with_light = frame.vs_mvp_with_light;
 
-            vs_mvp_with_light->mat_model = m_scene["plane"]->getModel();
+            vs_mvp_with_light.mat_proj       = frame.camera_proj;
+            vs_mvp_with_light.mat_view       = frame.camera_view;
+            vs_mvp_with_light.mat_light_proj = frame.light_proj;
+            vs_mvp_with_light.mat_light_view = frame.light_view;
 
-            m_rasterizer.render(m_scene["plane"]->getVertices(),
-                                m_scene["plane"]->getIndices(),
-                                *vs_mvp_with_light,
-                                *fs_pcss);
+            vs_mvp_with_light.mat_model = frame.models.at("plane");
+
+            frame.rasterizer.render(m_scene.at("plane")->getVertices(),
+                                    m_scene.at("plane")->getIndices(),
+                                    vs_mvp_with_light,
+                                    frame.fs_pcss);
         }
 
         {
-            vs_normal_mapping->mat_proj = camera_proj;
-            vs_normal_mapping->mat_view = camera_view;
+            VSNormalMapping& vs_normal_mapping = frame.vs_normal_mapping;
+
+            vs_normal_mapping.mat_proj = frame.camera_proj;
+            vs_normal_mapping.mat_view = frame.camera_view;
 
-            vs_normal_mapping->light_pos = m_light->getPosition();
-            vs_normal_mapping->view_pos  = m_render_camera->getPosition();
+            vs_normal_mapping.light_pos = frame.light_pos;
+            vs_normal_mapping.view_pos  = frame.camera_pos;
 
-            vs_normal_mapping->mat_model = m_scene["cube"]->getModel();
+            vs_normal_mapping.mat_model = frame.models.at("cube");
 
-            m_rasterizer.render(m_scene["cube"]->getVertices(),
-                                m_scene["cube"]->getIndices(),
-                                *vs_normal_mapping,
-                                *fs_normal_mapping);
+            frame.rasterizer.render(m_scene.at("cube")->getVertices(),
+                                    m_scene.at("cube")->getIndices(),
+                                    vs_normal_mapping,
+                                    *fs_normal_mapping);
         }
+
+        frame.rasterizer.resolve();
     }
 }
 
-void App::present()
+void App::present(Frame& frame)
 {
+    if (m_save_image)
+    {
+        frame.rasterizer.saveImage();
+        m_save_image = false;
+    }
+
+    // Upload the packed colors as they are.
+    GLenum type = GL_FLOAT;
+    switch (frame.rasterizer.getColorFormat())
+    {
+        case ColorFormat::RGBA32F: type = GL_FLOAT; break;
+        case ColorFormat::RGBA16F: type = GL_HALF_FLOAT; break;
+        case ColorFormat::RGB10A2: type = GL_UNSIGNED_INT_2_10_10_10_REV; break;
+        case ColorFormat::RGBA8: type = GL_UNSIGNED_BYTE; break;
+    }
+
     glTexSubImage2D(GL_TEXTURE_2D,
                     0,
                     0,
@@ -499,8 +579,8 @@ void App::present()
                     m_wnd_width,
                     m_wnd_height,
                     GL_RGBA,
-                    GL_FLOAT,
-                    m_rasterizer.getRenderResult().data());
+                    type,
+                    frame.rasterizer.getColorBuffer().data());
 
     glBindVertexArray(m_screen_vao);
     glBindTexture(GL_TEXTURE_2D, m_screen_tex);
@@ -1,4 +1,5 @@
 #pragma once
+#include <future>
 #include <memory>
 #include <string>
 #include <vector>
@@ -23,9 +24,41 @@ public:
     {
         std::string      name;
         Rasterizer::Desc rasterizer_desc;
+
+        // Frames rendered at the same time. The next frames are updated and
+        // rendered while the previous one finishes, 1 renders in sync.
+        int frames_in_flight = 2;
+
+        // The memory of the texture pages, the textures are streamed from
+        // their containers when it is not 0. Otherwise they are resident.
+        size_t texture_budget = 0;
     };
 
 private:
+    // Everything a frame in flight renders with. The scene state is copied in
+    // by the main thread, so that the scene can be updated meanwhile.
+    struct Frame
+    {
+        Rasterizer shadow_map;
+        Rasterizer rasterizer;
+
+        VSShadow        vs_light_pass;
+        VSMvpLight      vs_mvp_with_light;
+        VSNormalMapping vs_normal_mapping;
+        FSShadowPCSS    fs_pcss;
+
+        glm::mat4 camera_proj;
+        glm::mat4 camera_view;
+        glm::vec3 camera_pos;
+        glm::mat4 light_proj;
+        glm::mat4 light_view;
+        glm::vec3 light_pos;
+
+        std::unordered_map<std::string, glm::mat4> models;
+
+        std::future<void> done;  // Valid while the frame is rendering.
+    };
+
     // App class should only have one instance.
     App()                      = default;
     App(const App&)            = delete;
@@ -49,11 +82,13 @@ private:
 
     // Scene update and input handling.
     void update(float dt);
-    // Render / rasterizing the scene.
-    void draw();
+    // Copy the scene state to the frame, on the main thread.
+    void record(Frame& frame);
+    // Render / rasterizing the scene, on a worker thread.
+    void draw(Frame& frame);
 
     // Show render result.
-    void present();
+    void present(Frame& frame);
 
     // Event callbacks.
     void onCursorPos(double xpos, double ypos);
@@ -79,22 +114,22 @@ private:
     // but it's easier to understant which object is being rendered.
     std::unordered_map<std::string, std::shared_ptr<Primitive>> m_scene;
 
-    // Real part to calculate the pixels.
-    Rasterizer m_shadow_map;
-    Rasterizer m_rasterizer;
+    // Real part to calculate the pixels, one set of render targets and
+    // shader parameters per frame in flight.
+    std::vector<std::unique_ptr<Frame>> m_frames;
+    uint64_t                            m_frame_idx = 0;
 
-    // Shaders.
-    // Used in light pass.
-    std::unique_ptr<VSShadow> vs_light_pass;
-    std::unique_ptr<FSShadow> fs_light_pass;
+    // Applied to the frames when they are recorded.
+    int  m_sample_count = 1;
+    bool m_save_image   = false;
 
-    // Used by the plane which will show the cube's shadow.
-    // Soft shadow algorithm is PCSS.
-    std::unique_ptr<VSMvpLight>   vs_mvp_with_light;
-    std::unique_ptr<FSShadowPCSS> fs_pcss;
+    // Streams the virtual textures, when there is a texture budget. It
+    // outlives the shaders which own the textures.
+    std::unique_ptr<TexturePageCache> m_page_cache;
 
+    // Shaders shared by the frames, the ones with per frame parameters are
+    // in Frame. The plane which shows the cube's shadow uses PCSS.
     // Used by the cube, whose material is a brick wall with normal mapping.
-    std::unique_ptr<VSNormalMapping> vs_normal_mapping;
     std::unique_ptr<FSNormalMapping> fs_normal_mapping;
 
     // Others.
@@ -10,7 +10,9 @@ int main(int argc, char** argv)
     desc.rasterizer_desc.height = 720;                  // Window height.
     desc.rasterizer_desc.cull_model =
         Rasterizer::CullMode::CounterClockWise;  // Triangle cull mode.
-    desc.rasterizer_desc.enable_4x_msaa = true;  // Default using 4xmsaa.
+    desc.rasterizer_desc.sample_count = 4;  // Default using 4x msaa.
+    desc.frames_in_flight             = 2;  // Render 2 frames at once.
+    desc.texture_budget               = 0;  // Keep the textures resident.
 
     g_desc = &desc;
 
@@ -19,7 +19,7 @@ Plane::Plane(float scale_x, float scale_y, const glm::vec4& color)
     //  |         |
     //  |         |
     // 0|_________|1
-    m_vertices = std::vector<Vertex>{
+    std::vector<Vertex> vertices{
         Vertex{glm::vec3(-scale_x, -scale_y, 0.0f),
                glm::vec3(0.0f, 0.0f, 1.0f),
                glm::vec3(1.0f, 0.0f, 0.0f),
@@ -38,7 +38,8 @@ Plane::Plane(float scale_x, float scale_y, const glm::vec4& color)
                color, glm::vec2(0.0f, 1.0f)},
     };
 
-    m_indices = std::vector<size_t>{ 0, 1, 2, 0, 2, 3 };
+    m_vertices = VertexBuffer(vertices, true);
+    m_indices  = IndexBuffer({ 0, 1, 2, 0, 2, 3 });
 }
 
 Cube::Cube(float scale_x, float scale_y, float scale_z)
@@ -50,7 +51,7 @@ Cube::Cube(float scale_x, float scale_y, float scale_z)
     //   | /     | /        /
     //   |/______|/        /
     //  4       7         z+
-    m_vertices = std::vector<Vertex>{
+    std::vector<Vertex> vertices{
   /*
   * 2----1  y+
   * |    |  |
@@ -217,8 +218,9 @@ Cube::Cube(float scale_x, float scale_y, float scale_z)
                glm::vec2(1.0f, 1.0f)}, // 23
     };
 
-    m_indices =
-        std::vector<size_t>{ 0,  1,  2,  0,  2,  3,  5,  4,  6,  5,  6,  7,
-                             11, 10, 9,  11, 9,  8,  14, 15, 13, 14, 13, 12,
-                             19, 17, 16, 19, 16, 18, 21, 23, 22, 21, 22, 20 };
+    m_vertices = VertexBuffer(vertices, true);
+    m_indices  = IndexBuffer({ 0,  1,  2,  0,  2,  3,  5,  4,  6,
+                               5,  6,  7,  11, 10, 9,  11, 9,  8,
+                               14, 15, 13, 14, 13, 12, 19, 17, 16,
+                               19, 16, 18, 21, 23, 22, 21, 22, 20 });
 }
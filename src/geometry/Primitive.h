@@ -4,21 +4,23 @@
 #include <vector>
 
 #include "Vertex.h"
+#include "VertexBuffer.h"
 
 class Primitive
 {
 public:
     virtual ~Primitive() noexcept = default;
 
-    const std::vector<Vertex>& getVertices() const { return m_vertices; }
-    const std::vector<size_t>& getIndices() const { return m_indices; }
+    const VertexBuffer& getVertices() const { return m_vertices; }
+    const IndexBuffer&  getIndices() const { return m_indices; }
 
     void             setModel(const glm::mat4& matrix) { m_model = matrix; }
     const glm::mat4& getModel() const { return m_model; }
 
 protected:
-    std::vector<Vertex> m_vertices;
-    std::vector<size_t> m_indices;
+    // Quantized, which is lossless for the vertices of the shapes below.
+    VertexBuffer m_vertices;
+    IndexBuffer  m_indices;
 
     glm::mat4 m_model;
 };
@@ -1,4 +1,5 @@
 #pragma once
+#include <cstdint>
 
 #include <glm/glm.hpp>
 
@@ -9,4 +10,12 @@ struct Vertex
     glm::vec3 tangent;
     glm::vec4 basecolor;
     glm::vec2 texcoords;
-};
\ No newline at end of file
+
+    // Bits of the members, for the vertex shaders to declare what they read.
+    static constexpr uint32_t k_attribute_position  = 1u << 0;
+    static constexpr uint32_t k_attribute_normal    = 1u << 1;
+    static constexpr uint32_t k_attribute_tangent   = 1u << 2;
+    static constexpr uint32_t k_attribute_basecolor = 1u << 3;
+    static constexpr uint32_t k_attribute_texcoords = 1u << 4;
+    static constexpr uint32_t k_attribute_all       = 0x1f;
+};
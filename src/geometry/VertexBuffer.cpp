@@ -0,0 +1,55 @@
+#include "VertexBuffer.h"
+
+VertexBuffer::VertexBuffer(const std::vector<Vertex>& vertices, bool quantized)
+    : m_quantized(quantized)
+{
+    m_positions.reserve(vertices.size());
+    for (const Vertex& vertex : vertices)
+    {
+        m_positions.push_back(vertex.position);
+        if (m_quantized)
+        {
+            m_packed_normals.push_back(packOctahedral(vertex.normal));
+            m_packed_tangents.push_back(packOctahedral(vertex.tangent));
+            m_packed_colors.push_back(glm::packUnorm4x8(vertex.basecolor));
+            m_packed_texcoords.push_back(glm::packHalf2x16(vertex.texcoords));
+        }
+        else
+        {
+            m_normals.push_back(vertex.normal);
+            m_tangents.push_back(vertex.tangent);
+            m_colors.push_back(vertex.basecolor);
+            m_texcoords.push_back(vertex.texcoords);
+        }
+    }
+}
+
+uint32_t VertexBuffer::packOctahedral(const glm::vec3& v)
+{
+    const float l1 = std::abs(v.x) + std::abs(v.y) + std::abs(v.z);
+    glm::vec2   p  = (l1 > 0.0f) ? glm::vec2(v.x, v.y) / l1 : glm::vec2(0.0f);
+
+    // The lower half is folded over the diagonals.
+    if (v.z < 0.0f)
+    {
+        p = glm::vec2((1.0f - std::abs(p.y)) * (p.x >= 0.0f ? 1.0f : -1.0f),
+                      (1.0f - std::abs(p.x)) * (p.y >= 0.0f ? 1.0f : -1.0f));
+    }
+    return glm::packSnorm2x16(p);
+}
+
+IndexBuffer::IndexBuffer(const std::vector<uint32_t>& indices)
+{
+    const uint32_t max_index =
+        indices.empty() ? 0 : *std::max_element(indices.begin(), indices.end());
+
+    m_is_16bit = (max_index <= UINT16_MAX);
+    if (m_is_16bit)
+    {
+        m_indices_16.assign(indices.begin(), indices.end());
+    }
+    else
+    {
+        m_indices_32 = indices;
+    }
+}
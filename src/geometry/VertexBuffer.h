@@ -0,0 +1,117 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+
+#include "Vertex.h"
+
+// Vertex attributes in separate streams, so that a vertex shader only reads
+// the attributes it declares. The quantized format packs normals and tangents
+// in octahedral snorm16, colors in unorm8 and texcoords in half floats, and
+// keeps float positions.
+class VertexBuffer
+{
+public:
+    VertexBuffer() = default;
+    explicit VertexBuffer(const std::vector<Vertex>& vertices,
+                          bool                       quantized = false);
+
+    size_t size() const { return m_positions.size(); }
+    bool   isQuantized() const { return m_quantized; }
+
+    // The only attribute the depth only draws read.
+    const glm::vec3& getPosition(size_t i) const { return m_positions[i]; }
+
+    // The attributes in Attributes, the other members are left at zero.
+    template <uint32_t Attributes>
+    Vertex getVertex(size_t i) const
+    {
+        Vertex vertex{};
+        if constexpr (Attributes & Vertex::k_attribute_position)
+        {
+            vertex.position = m_positions[i];
+        }
+        if constexpr (Attributes & Vertex::k_attribute_normal)
+        {
+            vertex.normal = m_quantized ? unpackOctahedral(m_packed_normals[i])
+                                        : m_normals[i];
+        }
+        if constexpr (Attributes & Vertex::k_attribute_tangent)
+        {
+            vertex.tangent = m_quantized
+                                 ? unpackOctahedral(m_packed_tangents[i])
+                                 : m_tangents[i];
+        }
+        if constexpr (Attributes & Vertex::k_attribute_basecolor)
+        {
+            vertex.basecolor = m_quantized
+                                   ? glm::unpackUnorm4x8(m_packed_colors[i])
+                                   : m_colors[i];
+        }
+        if constexpr (Attributes & Vertex::k_attribute_texcoords)
+        {
+            vertex.texcoords = m_quantized
+                                   ? glm::unpackHalf2x16(m_packed_texcoords[i])
+                                   : m_texcoords[i];
+        }
+        return vertex;
+    }
+
+    // Unit vectors mapped to the octahedron and unfolded to a square.
+    static uint32_t  packOctahedral(const glm::vec3& v);
+    static glm::vec3 unpackOctahedral(uint32_t packed)
+    {
+        glm::vec2 p = glm::unpackSnorm2x16(packed);
+        glm::vec3 v(p.x, p.y, 1.0f - std::abs(p.x) - std::abs(p.y));
+
+        const float t = std::max(-v.z, 0.0f);
+        v.x += (v.x >= 0.0f) ? -t : t;
+        v.y += (v.y >= 0.0f) ? -t : t;
+        return glm::normalize(v);
+    }
+
+private:
+    bool m_quantized = false;
+
+    std::vector<glm::vec3> m_positions;
+
+    // Float streams.
+    std::vector<glm::vec3> m_normals;
+    std::vector<glm::vec3> m_tangents;
+    std::vector<glm::vec4> m_colors;
+    std::vector<glm::vec2> m_texcoords;
+
+    // Quantized streams.
+    std::vector<uint32_t> m_packed_normals;
+    std::vector<uint32_t> m_packed_tangents;
+    std::vector<uint32_t> m_packed_colors;
+    std::vector<uint32_t> m_packed_texcoords;
+};
+
+// Triangle list indices, stored in 16 bits when every index fits.
+class IndexBuffer
+{
+public:
+    IndexBuffer() = default;
+    explicit IndexBuffer(const std::vector<uint32_t>& indices);
+
+    size_t size() const
+    {
+        return m_is_16bit ? m_indices_16.size() : m_indices_32.size();
+    }
+    bool is16Bit() const { return m_is_16bit; }
+
+    uint32_t operator[](size_t i) const
+    {
+        return m_is_16bit ? m_indices_16[i] : m_indices_32[i];
+    }
+
+private:
+    bool                  m_is_16bit = false;
+    std::vector<uint16_t> m_indices_16;
+    std::vector<uint32_t> m_indices_32;
+};
@@ -0,0 +1,322 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include <glm/glm.hpp>
+
+// The 4x4 texel blocks of the BC1, BC3, BC4 and BC5 formats. A block decodes
+// to its 16 texels in rows, packed in RGBA8 with red in the lowest byte.
+static constexpr int      k_bc_block_size  = 4;
+static constexpr int      k_bc_texel_count = k_bc_block_size * k_bc_block_size;
+static constexpr int      k_bc_bc4_bytes   = 8;
+static constexpr uint32_t k_bc_alpha       = 0xff000000u;
+
+inline uint32_t packBCColor(uint32_t r, uint32_t g, uint32_t b, uint32_t a)
+{
+    return r | (g << 8) | (b << 16) | (a << 24);
+}
+
+inline uint32_t getBCChannel(uint32_t color, int channel)
+{
+    return (color >> (channel * 8)) & 0xffu;
+}
+
+// The 8 values of a BC4 block. With v0 <= v1, 6 values are interpolated and
+// the last ones are 0 and 255.
+inline void getBC4Palette(uint32_t v0, uint32_t v1, uint8_t palette[8])
+{
+    palette[0] = uint8_t(v0);
+    palette[1] = uint8_t(v1);
+    if (v0 > v1)
+    {
+        for (uint32_t i = 1; i < 7; ++i)
+        {
+            palette[i + 1] = uint8_t(((7 - i) * v0 + i * v1) / 7);
+        }
+    }
+    else
+    {
+        for (uint32_t i = 1; i < 5; ++i)
+        {
+            palette[i + 1] = uint8_t(((5 - i) * v0 + i * v1) / 5);
+        }
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+}
+
+inline void decodeBC4Channel(const uint8_t* block, uint8_t values[16])
+{
+    uint8_t palette[8];
+    getBC4Palette(block[0], block[1], palette);
+
+    uint64_t indices = 0;
+    std::memcpy(&indices, block + 2, 6);
+    for (int i = 0; i < k_bc_texel_count; ++i)
+    {
+        values[i] = palette[(indices >> (3 * i)) & 7];
+    }
+}
+
+// The 4 colors of a BC1 block. With c0 <= c1, the block has 3 colors and a
+// transparent black, except in BC3 which always uses 4 colors.
+inline void getBC1Palette(uint16_t c0,
+                          uint16_t c1,
+                          bool     four_colors,
+                          uint32_t palette[4])
+{
+    auto expand565 = [](uint16_t color)
+    {
+        const uint32_t r = (color >> 11) & 0x1f;
+        const uint32_t g = (color >> 5) & 0x3f;
+        const uint32_t b = color & 0x1f;
+        return packBCColor(
+            (r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2), 255);
+    };
+    palette[0] = expand565(c0);
+    palette[1] = expand565(c1);
+
+    auto blend = [&](uint32_t w0, uint32_t w1, uint32_t sum)
+    {
+        uint32_t color = k_bc_alpha;
+        for (int c = 0; c < 3; ++c)
+        {
+            color |= ((w0 * getBCChannel(palette[0], c) +
+                       w1 * getBCChannel(palette[1], c)) /
+                      sum)
+                     << (c * 8);
+        }
+        return color;
+    };
+    if (four_colors || c0 > c1)
+    {
+        palette[2] = blend(2, 1, 3);
+        palette[3] = blend(1, 2, 3);
+    }
+    else
+    {
+        palette[2] = blend(1, 1, 2);
+        palette[3] = 0;
+    }
+}
+
+inline void decodeBC1Color(const uint8_t* block,
+                           bool           four_colors,
+                           uint32_t       texels[16])
+{
+    uint16_t c0, c1;
+    uint32_t indices;
+    std::memcpy(&c0, block, sizeof(c0));
+    std::memcpy(&c1, block + 2, sizeof(c1));
+    std::memcpy(&indices, block + 4, sizeof(indices));
+
+    uint32_t palette[4];
+    getBC1Palette(c0, c1, four_colors, palette);
+    for (int i = 0; i < k_bc_texel_count; ++i)
+    {
+        texels[i] = palette[(indices >> (2 * i)) & 3];
+    }
+}
+
+inline void decodeBC1Block(const uint8_t* block, uint32_t texels[16])
+{
+    decodeBC1Color(block, false, texels);
+}
+
+// The alpha block is followed by a color block.
+inline void decodeBC3Block(const uint8_t* block, uint32_t texels[16])
+{
+    uint8_t alpha[16];
+    decodeBC4Channel(block, alpha);
+    decodeBC1Color(block + k_bc_bc4_bytes, true, texels);
+    for (int i = 0; i < k_bc_texel_count; ++i)
+    {
+        texels[i] = (texels[i] & ~k_bc_alpha) | (uint32_t(alpha[i]) << 24);
+    }
+}
+
+inline void decodeBC4Block(const uint8_t* block, uint32_t texels[16])
+{
+    uint8_t red[16];
+    decodeBC4Channel(block, red);
+    for (int i = 0; i < k_bc_texel_count; ++i)
+    {
+        texels[i] = packBCColor(red[i], 0, 0, 255);
+    }
+}
+
+// A red block followed by a green block.
+inline void decodeBC5Block(const uint8_t* block, uint32_t texels[16])
+{
+    uint8_t red[16];
+    uint8_t green[16];
+    decodeBC4Channel(block, red);
+    decodeBC4Channel(block + k_bc_bc4_bytes, green);
+    for (int i = 0; i < k_bc_texel_count; ++i)
+    {
+        texels[i] = packBCColor(red[i], green[i], 0, 255);
+    }
+}
+
+// The encoders fit the endpoints to the range of the block and pick the
+// nearest palette entry for every texel. They are meant for converting
+// images when they are loaded, not for offline quality.
+inline void encodeBC4Channel(const float values[16], uint8_t* block)
+{
+    uint8_t bytes[16];
+    for (int i = 0; i < k_bc_texel_count; ++i)
+    {
+        bytes[i] = uint8_t(std::clamp(values[i], 0.0f, 1.0f) * 255.0f + 0.5f);
+    }
+    const uint8_t lo = *std::min_element(bytes, bytes + k_bc_texel_count);
+    const uint8_t hi = *std::max_element(bytes, bytes + k_bc_texel_count);
+
+    // Highest first, for the 8 interpolated values.
+    block[0] = hi;
+    block[1] = lo;
+    uint8_t palette[8];
+    getBC4Palette(hi, lo, palette);
+
+    uint64_t indices = 0;
+    for (int i = 0; i < k_bc_texel_count; ++i)
+    {
+        uint64_t best       = 0;
+        int      best_error = 256;
+        for (int p = 0; p < 8; ++p)
+        {
+            const int error = std::abs(int(palette[p]) - int(bytes[i]));
+            if (error < best_error)
+            {
+                best       = p;
+                best_error = error;
+            }
+        }
+        indices |= best << (3 * i);
+    }
+    std::memcpy(block + 2, &indices, 6);
+}
+
+// The endpoints are on the principal axis of the colors. The alpha is not
+// encoded, the 4 color mode is always used.
+inline void encodeBC1Color(const glm::vec4 texels[16], uint8_t* block)
+{
+    glm::vec3 colors[16];
+    glm::vec3 mean(0.0f);
+    for (int i = 0; i < k_bc_texel_count; ++i)
+    {
+        colors[i] = glm::clamp(glm::vec3(texels[i]), 0.0f, 1.0f);
+        mean += colors[i];
+    }
+    mean /= float(k_bc_texel_count);
+
+    glm::mat3 covariance(0.0f);
+    for (int i = 0; i < k_bc_texel_count; ++i)
+    {
+        covariance += glm::outerProduct(colors[i] - mean, colors[i] - mean);
+    }
+
+    // Power iterations, starting from the largest variance.
+    glm::vec3 axis(covariance[0][0], covariance[1][1], covariance[2][2]);
+    for (int i = 0; i < 4; ++i)
+    {
+        axis = covariance * axis;
+        const float length = glm::length(axis);
+        if (!(length > 0.0f))
+        {
+            break;
+        }
+        axis /= length;
+    }
+
+    float t_lo = 0.0f;
+    float t_hi = 0.0f;
+    for (int i = 0; i < k_bc_texel_count; ++i)
+    {
+        const float t = glm::dot(colors[i] - mean, axis);
+        t_lo          = std::min(t_lo, t);
+        t_hi          = std::max(t_hi, t);
+    }
+
+    auto to565 = [](const glm::vec3& color)
+    {
+        const glm::vec3 c = glm::clamp(color, 0.0f, 1.0f);
+        return uint16_t((uint32_t(c.r * 31.0f + 0.5f) << 11) |
+                        (uint32_t(c.g * 63.0f + 0.5f) << 5) |
+                        uint32_t(c.b * 31.0f + 0.5f));
+    };
+    uint16_t c0 = to565(mean + axis * t_hi);
+    uint16_t c1 = to565(mean + axis * t_lo);
+    if (c0 < c1)
+    {
+        std::swap(c0, c1);
+    }
+
+    uint32_t palette[4];
+    getBC1Palette(c0, c1, true, palette);
+
+    uint32_t indices = 0;
+    for (int i = 0; i < k_bc_texel_count; ++i)
+    {
+        const glm::vec3 color = colors[i] * 255.0f;
+
+        uint32_t best       = 0;
+        float    best_error = 0.0f;
+        for (uint32_t p = 0; p < 4; ++p)
+        {
+            const glm::vec3 d = color - glm::vec3(getBCChannel(palette[p], 0),
+                                                  getBCChannel(palette[p], 1),
+                                                  getBCChannel(palette[p], 2));
+            const float error = glm::dot(d, d);
+            if (p == 0 || error < best_error)
+            {
+                best       = p;
+                best_error = error;
+            }
+        }
+        indices |= best << (2 * i);
+    }
+
+    std::memcpy(block, &c0, sizeof(c0));
+    std::memcpy(block + 2, &c1, sizeof(c1));
+    std::memcpy(block + 4, &indices, sizeof(indices));
+}
+
+inline void encodeBC1Block(const glm::vec4 texels[16], uint8_t* block)
+{
+    encodeBC1Color(texels, block);
+}
+
+inline void encodeBC3Block(const glm::vec4 texels[16], uint8_t* block)
+{
+    float alpha[16];
+    for (int i = 0; i < k_bc_texel_count; ++i)
+    {
+        alpha[i] = texels[i].a;
+    }
+    encodeBC4Channel(alpha, block);
+    encodeBC1Color(texels, block + k_bc_bc4_bytes);
+}
+
+inline void encodeBC4Block(const glm::vec4 texels[16], uint8_t* block)
+{
+    float red[16];
+    for (int i = 0; i < k_bc_texel_count; ++i)
+    {
+        red[i] = texels[i].r;
+    }
+    encodeBC4Channel(red, block);
+}
+
+inline void encodeBC5Block(const glm::vec4 texels[16], uint8_t* block)
+{
+    float red[16];
+    float green[16];
+    for (int i = 0; i < k_bc_texel_count; ++i)
+    {
+        red[i]   = texels[i].r;
+        green[i] = texels[i].g;
+    }
+    encodeBC4Channel(red, block);
+    encodeBC4Channel(green, block + k_bc_bc4_bytes);
+}
@@ -0,0 +1,109 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/color_space.hpp>
+#include <glm/gtc/packing.hpp>
+
+// Storage formats of the color buffer. Colors are packed when they are
+// written, and presenting or saving reads the packed data directly.
+enum class ColorFormat
+{
+    RGBA32F = 0,  // 4 floats.
+    RGBA16F,      // 4 half floats.
+    RGB10A2,      // Unorm, red in the lowest bits.
+    RGBA8         // Unorm, red in the first byte.
+};
+
+inline constexpr size_t k_max_color_size = 16;
+
+inline size_t getColorFormatSize(ColorFormat format)
+{
+    switch (format)
+    {
+        case ColorFormat::RGBA32F: return 16;
+        case ColorFormat::RGBA16F: return 8;
+        default: return 4;
+    }
+}
+
+// With srgb set, the color channels are encoded from linear to sRGB.
+inline void packColor(ColorFormat      format,
+                      bool             srgb,
+                      const glm::vec4& color,
+                      uint8_t*         dst)
+{
+    glm::vec4 value = color;
+    if (srgb)
+    {
+        value = glm::vec4(glm::convertLinearToSRGB(glm::vec3(color)), color.a);
+    }
+
+    switch (format)
+    {
+        case ColorFormat::RGBA32F:
+        {
+            std::memcpy(dst, &value, sizeof(value));
+            break;
+        }
+        case ColorFormat::RGBA16F:
+        {
+            uint64_t packed = glm::packHalf4x16(value);
+            std::memcpy(dst, &packed, sizeof(packed));
+            break;
+        }
+        case ColorFormat::RGB10A2:
+        {
+            uint32_t packed = glm::packUnorm3x10_1x2(value);
+            std::memcpy(dst, &packed, sizeof(packed));
+            break;
+        }
+        case ColorFormat::RGBA8:
+        {
+            uint32_t packed = glm::packUnorm4x8(value);
+            std::memcpy(dst, &packed, sizeof(packed));
+            break;
+        }
+    }
+}
+
+inline glm::vec4 unpackColor(ColorFormat format, bool srgb, const uint8_t* src)
+{
+    glm::vec4 value(0.0f);
+    switch (format)
+    {
+        case ColorFormat::RGBA32F:
+        {
+            std::memcpy(&value, src, sizeof(value));
+            break;
+        }
+        case ColorFormat::RGBA16F:
+        {
+            uint64_t packed;
+            std::memcpy(&packed, src, sizeof(packed));
+            value = glm::unpackHalf4x16(packed);
+            break;
+        }
+        case ColorFormat::RGB10A2:
+        {
+            uint32_t packed;
+            std::memcpy(&packed, src, sizeof(packed));
+            value = glm::unpackUnorm3x10_1x2(packed);
+            break;
+        }
+        case ColorFormat::RGBA8:
+        {
+            uint32_t packed;
+            std::memcpy(&packed, src, sizeof(packed));
+            value = glm::unpackUnorm4x8(packed);
+            break;
+        }
+    }
+
+    if (srgb)
+    {
+        value = glm::vec4(glm::convertSRGBToLinear(glm::vec3(value)), value.a);
+    }
+    return value;
+}
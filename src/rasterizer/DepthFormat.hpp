@@ -0,0 +1,120 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+
+#include "TiledLayout.hpp"
+
+// Storage formats of the depth buffer. Depth is in [0, 1], the unorm formats
+// round it to the nearest step.
+enum class DepthFormat
+{
+    D32F = 0,  // float.
+    D24,       // 24 bit unorm, in the low bits of 32 bits.
+    D16        // 16 bit unorm.
+};
+
+template <DepthFormat Format>
+struct DepthTraits;
+
+template <>
+struct DepthTraits<DepthFormat::D32F>
+{
+    using Type = float;
+
+    static float encode(float depth) { return depth; }
+    static float decode(float value) { return value; }
+};
+
+template <>
+struct DepthTraits<DepthFormat::D24>
+{
+    using Type = uint32_t;
+
+    static constexpr uint32_t k_max = (1u << 24) - 1;
+
+    static uint32_t encode(float depth)
+    {
+        return uint32_t(std::clamp(depth, 0.0f, 1.0f) * float(k_max) + 0.5f);
+    }
+    static float decode(uint32_t value) { return float(value) / float(k_max); }
+};
+
+template <>
+struct DepthTraits<DepthFormat::D16>
+{
+    using Type = uint16_t;
+
+    static constexpr uint32_t k_max = (1u << 16) - 1;
+
+    static uint16_t encode(float depth)
+    {
+        return uint16_t(std::clamp(depth, 0.0f, 1.0f) * float(k_max) + 0.5f);
+    }
+    static float decode(uint16_t value) { return float(value) / float(k_max); }
+};
+
+inline size_t getDepthFormatSize(DepthFormat format)
+{
+    switch (format)
+    {
+        case DepthFormat::D16: return 2;
+        default: return 4;
+    }
+}
+
+// The stored value of a depth, as a float. It is exact for the unorm formats,
+// so that depth ranges can be compared to the buffer without decoding.
+inline float getDepthValue(DepthFormat format, float depth)
+{
+    switch (format)
+    {
+        case DepthFormat::D24:
+            return float(DepthTraits<DepthFormat::D24>::encode(depth));
+        case DepthFormat::D16:
+            return float(DepthTraits<DepthFormat::D16>::encode(depth));
+        default: return depth;
+    }
+}
+
+// Read access to a depth buffer, e.g. for sampling a shadow map. Only the
+// first sample of a pixel is read.
+struct DepthBufferView
+{
+    const void* data         = nullptr;
+    DepthFormat format       = DepthFormat::D32F;
+    int         width        = 0;
+    int         height       = 0;
+    int         sample_count = 1;
+    bool        tiled        = false;  // In the tiled layout.
+
+    // Fast clear: the k_layout_tile_size^2 tiles flagged here hold
+    // clear_depth, whatever their data is.
+    const uint8_t* tile_cleared = nullptr;
+    float          clear_depth  = 1.0f;
+
+    float load(int x, int y) const
+    {
+        const int tile_count_x =
+            (width + k_layout_tile_size - 1) / k_layout_tile_size;
+        if (tile_cleared &&
+            tile_cleared[(y >> k_layout_tile_bits) * tile_count_x +
+                         (x >> k_layout_tile_bits)])
+        {
+            return clear_depth;
+        }
+
+        const size_t pixel_idx = tiled ? getTiledIdx(x, y, tile_count_x)
+                                       : size_t(y) * width + x;
+        const size_t idx = pixel_idx * sample_count;
+        switch (format)
+        {
+            case DepthFormat::D24:
+                return DepthTraits<DepthFormat::D24>::decode(
+                    static_cast<const uint32_t*>(data)[idx]);
+            case DepthFormat::D16:
+                return DepthTraits<DepthFormat::D16>::decode(
+                    static_cast<const uint16_t*>(data)[idx]);
+            default: return static_cast<const float*>(data)[idx];
+        }
+    }
+};
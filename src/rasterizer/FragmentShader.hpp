@@ -7,9 +7,18 @@
 #include <glm/glm.hpp>
 
 #include "geometry/Vertex.h"
-#include "rasterizer/Texture.h"
+#include "rasterizer/DepthFormat.hpp"
+#include "rasterizer/TextureLoader.h"
 #include "utils/Utils.hpp"
 
+// The varyings declared by the fragment shader type Shader. The type tag
+// keeps a shader from using the set of its parent shader.
+template <typename Shader>
+struct VaryingSet
+{
+    uint32_t mask;
+};
+
 struct FragmentShader
 {
     struct Input
@@ -23,14 +32,37 @@ struct FragmentShader
         glm::vec3 tangent_space_light_pos;
         glm::vec3 tangent_space_view_pos;
         glm::vec3 tangent_space_frag_pos;
+
+        // Screen space derivatives of texcoords, for the mip selection.
+        glm::vec2 texcoords_dx;
+        glm::vec2 texcoords_dy;
     };
 
+    // Bits of the Input members.
+    static constexpr uint32_t k_varying_mv_position             = 1u << 0;
+    static constexpr uint32_t k_varying_mv_normal               = 1u << 1;
+    static constexpr uint32_t k_varying_color                   = 1u << 2;
+    static constexpr uint32_t k_varying_light_space_pos         = 1u << 3;
+    static constexpr uint32_t k_varying_texcoords               = 1u << 4;
+    static constexpr uint32_t k_varying_tangent_space_light_pos = 1u << 5;
+    static constexpr uint32_t k_varying_tangent_space_view_pos  = 1u << 6;
+    static constexpr uint32_t k_varying_tangent_space_frag_pos  = 1u << 7;
+    static constexpr uint32_t k_varying_texcoords_derivatives   = 1u << 8;
+    static constexpr uint32_t k_varying_all                     = 0x1ff;
+
+    // The Input members a shader reads, the others are not interpolated and
+    // stay zero. Every shader type declares its own set, render() does not
+    // compile with the set of a parent shader.
+    static constexpr VaryingSet<FragmentShader> k_varyings{ k_varying_all };
+
     virtual glm::vec4 operator()(const Input& input) const = 0;
 };
 
 // Simply show the default color.
-struct FSFlat : public FragmentShader
+struct FSFlat final : public FragmentShader
 {
+    static constexpr VaryingSet<FSFlat> k_varyings{ k_varying_color };
+
     glm::vec4 operator()(const Input& input) const override
     {
         return input.color;
@@ -41,9 +73,9 @@ struct FSFlat : public FragmentShader
 // buffer.
 struct FSShadow : public FragmentShader
 {
-    int          shadow_map_width;
-    int          shadow_map_height;
-    const float* shadow_map_texture = nullptr;
+    static constexpr VaryingSet<FSShadow> k_varyings{ 0 };
+
+    DepthBufferView shadow_map;
 
     glm::vec4 operator()(const Input& input) const override
     {
@@ -53,20 +85,23 @@ struct FSShadow : public FragmentShader
 protected:
     float sampleShadowMap(glm::vec2 texcoords) const
     {
-        int x = shadow_map_width * texcoords.x;
-        int y = shadow_map_height * texcoords.y;
+        int x = shadow_map.width * texcoords.x;
+        int y = shadow_map.height * texcoords.y;
 
-        x = std::clamp(x, 0, shadow_map_width - 1);
-        y = std::clamp(y, 0, shadow_map_height - 1);
+        x = std::clamp(x, 0, shadow_map.width - 1);
+        y = std::clamp(y, 0, shadow_map.height - 1);
 
-        int index = y * shadow_map_width + x;
-        return shadow_map_texture[index];
+        return shadow_map.load(x, y);
     }
 };
 
 // Use for shadow map debug. This shader will use the shadow map as a texture.
-struct FSShadowDebug : public FSShadow
+struct FSShadowDebug final : public FSShadow
 {
+    static constexpr VaryingSet<FSShadowDebug> k_varyings{
+        k_varying_texcoords
+    };
+
     glm::vec4 operator()(const Input& input) const override
     {
         float depth = sampleShadowMap(input.texcoords);
@@ -75,8 +110,12 @@ struct FSShadowDebug : public FSShadow
 };
 
 // The shader that will use shadow map to calculate the shadow area.
-struct FSShadowDraw : public FSShadow
+struct FSShadowDraw final : public FSShadow
 {
+    static constexpr VaryingSet<FSShadowDraw> k_varyings{
+        k_varying_light_space_pos
+    };
+
     glm::vec4 operator()(const Input& input) const override
     {
         glm::vec3 proj_coords =
@@ -95,8 +134,12 @@ struct FSShadowDraw : public FSShadow
     }
 };
 
-struct FSShadowPCSS : public FSShadow
+struct FSShadowPCSS final : public FSShadow
 {
+    static constexpr VaryingSet<FSShadowPCSS> k_varyings{
+        k_varying_light_space_pos | k_varying_color
+    };
+
     glm::vec3 view_light_pos;
 
     glm::vec4 operator()(const Input& input) const override
@@ -164,17 +207,17 @@ private:
         bool  is_blocked          = false;
         for (int i = 0; i < k_sample_count; ++i)
         {
-            int u = texcoords.x * shadow_map_width +
+            int u = texcoords.x * shadow_map.width +
                     sample_disk[i].x * k_block_radius;
-            int v = texcoords.y * shadow_map_height +
+            int v = texcoords.y * shadow_map.height +
                     sample_disk[i].y * k_block_radius;
-            if (u < 0 || u >= shadow_map_width || v < 0 ||
-                v >= shadow_map_height)
+            if (u < 0 || u >= shadow_map.width || v < 0 ||
+                v >= shadow_map.height)
             {
                 continue;
             }
 
-            float texture_depth = shadow_map_texture[v * shadow_map_width + u];
+            float texture_depth = shadow_map.load(u, v);
             if (current_depth + 0.01f > texture_depth)
             {
                 block_average_depth += texture_depth;
@@ -204,19 +247,19 @@ private:
         int   real_sample_count = 0;
         for (int i = 0; i < k_sample_count; ++i)
         {
-            int u = shadow_texcoords.x * shadow_map_width +
+            int u = shadow_texcoords.x * shadow_map.width +
                     sample_disk[i].x * penumbra_size;
-            int v = shadow_texcoords.y * shadow_map_height +
+            int v = shadow_texcoords.y * shadow_map.height +
                     sample_disk[i].y * penumbra_size;
 
-            if (u < 0 || u >= shadow_map_width || v < 0 ||
-                v >= shadow_map_height)
+            if (u < 0 || u >= shadow_map.width || v < 0 ||
+                v >= shadow_map.height)
             {
                 continue;
             }
             ++real_sample_count;
 
-            float texture_depth = shadow_map_texture[v * shadow_map_width + u];
+            float texture_depth = shadow_map.load(u, v);
 
             visibility +=
                 (texture_depth + 0.02f > shadow_texcoords.z) ? 1.0f : 0.0f;
@@ -226,34 +269,93 @@ private:
     }
 };
 
-struct FSShowTexture : public FragmentShader
+struct FSShowTexture final : public FragmentShader
 {
-    Texture texture;
+    static constexpr VaryingSet<FSShowTexture> k_varyings{
+        k_varying_texcoords | k_varying_texcoords_derivatives
+    };
+
+    std::shared_ptr<const Texture> texture;
 
-    FSShowTexture(const std::string& path) : texture(path) {}
+    FSShowTexture(const std::string& path)
+        : texture(TextureLoader::getInstance().load(path).get())
+    {}
     glm::vec4 operator()(const Input& input) const override
     {
-        return texture.sample(input.texcoords.x, input.texcoords.y, 1);
+        return texture->sample(input.texcoords.x,
+                               input.texcoords.y,
+                               input.texcoords_dx,
+                               input.texcoords_dy);
     }
 };
 
-struct FSNormalMapping : public FragmentShader
+struct FSNormalMapping final : public FragmentShader
 {
-    Texture diffuse_tex;
-    Texture normal_tex;
+    static constexpr VaryingSet<FSNormalMapping> k_varyings{
+        k_varying_texcoords | k_varying_texcoords_derivatives |
+        k_varying_tangent_space_light_pos | k_varying_tangent_space_view_pos |
+        k_varying_tangent_space_frag_pos
+    };
 
+    std::shared_ptr<const Texture> diffuse_tex;
+    std::shared_ptr<const Texture> normal_tex;
+
+    // The maps are compressed, the normals keep only x and y. They are loaded
+    // at the same time, or streamed by page_cache from their containers. A
+    // map without a valid container is loaded whole.
     FSNormalMapping(const std::string& diffuse_path,
-                    const std::string& normal_path)
-        : diffuse_tex(diffuse_path), normal_tex(normal_path)
-    {}
+                    const std::string& normal_path,
+                    TexturePageCache*  page_cache = nullptr)
+    {
+        if (page_cache)
+        {
+            diffuse_tex = Texture::createVirtual(
+                Texture::getContainerPath(diffuse_path, TextureFormat::BC1),
+                *page_cache);
+            normal_tex = Texture::createVirtual(
+                Texture::getContainerPath(normal_path, TextureFormat::BC5),
+                *page_cache);
+        }
+
+        TextureLoader& loader = TextureLoader::getInstance();
+        TextureHandle  diffuse;
+        TextureHandle  normal;
+        if (!diffuse_tex)
+        {
+            diffuse = loader.load(diffuse_path, TextureFormat::BC1);
+        }
+        if (!normal_tex)
+        {
+            normal = loader.load(normal_path, TextureFormat::BC5);
+        }
+        if (diffuse.valid())
+        {
+            diffuse_tex = diffuse.get();
+        }
+        if (normal.valid())
+        {
+            normal_tex = normal.get();
+        }
+    }
     glm::vec4 operator()(const Input& input) const override
     {
         // Prepare.
-        glm::vec3 color =
-            diffuse_tex.sample(input.texcoords.x, input.texcoords.y, 1);
-        glm::vec3 normal = normal_tex.sample(
-            input.texcoords.x, input.texcoords.y, 1);  // tangent space
+        glm::vec3 color = diffuse_tex->sample(input.texcoords.x,
+                                              input.texcoords.y,
+                                              input.texcoords_dx,
+                                              input.texcoords_dy);
+        // Tangent space.
+        glm::vec3 normal = normal_tex->sample(input.texcoords.x,
+                                              input.texcoords.y,
+                                              input.texcoords_dx,
+                                              input.texcoords_dy);
         normal = normal * 2.0f - glm::vec3(1.0f, 1.0f, 1.0f);
+        if (getTextureChannelCount(normal_tex->getFormat()) == 2)
+        {
+            normal.z = std::sqrt(
+                std::max(1.0f - normal.x * normal.x - normal.y * normal.y,
+                         0.0f));
+        }
 
         glm::vec3 light_dir = glm::normalize(input.tangent_space_light_pos -
                                              input.tangent_space_frag_pos);
@@ -0,0 +1,256 @@
+#pragma once
+#include <cstdint>
+
+#include "DepthFormat.hpp"
+
+// RASTER_KERNEL_SCALAR forces the scalar loop, to test it on x86.
+#if defined(RASTER_KERNEL_SCALAR)
+#elif defined(__AVX2__)
+#    define RASTER_KERNEL_AVX2
+#    include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#    define RASTER_KERNEL_SSE2
+#    include <emmintrin.h>
+#endif
+
+// The coverage and depth test kernel of the rasterizer. It works on groups of
+// k_raster_lane_count samples whose depth values are contiguous in the depth
+// buffer, e.g. 8 pixels of a row, 2 pixels x 4 msaa samples, or half of the
+// samples of a 16x msaa pixel. AVX2 handles a group at once, SSE2 in two
+// halves, otherwise a scalar loop is used.
+static constexpr int k_raster_lane_count = 8;
+
+// Per-triangle constants of a lane pattern.
+struct RasterLanes
+{
+    // Edge value offset of every lane from the group origin.
+    alignas(32) int32_t edge[3][k_raster_lane_count];
+    // 1 / depth offset of every lane from the group origin.
+    alignas(32) float inv_z[k_raster_lane_count];
+    // A lane is inside an edge when its value is larger than this (the fill
+    // rule bias - 1).
+    int32_t edge_threshold[3];
+};
+
+// Per-group inputs.
+struct RasterGroup
+{
+    int32_t  edge[3];     // Edge values at the group origin.
+    uint32_t edge_mask;   // The edges which need to be tested.
+    float    inv_z;       // 1 / depth at the group origin.
+    uint32_t lane_mask;   // The lanes inside the render area.
+    void*    depth;       // The depth values of the lanes.
+    bool     test_depth;  // Unset when all the lanes are known to pass.
+    bool     write_depth;
+};
+
+// Returns the lanes covered by the triangle in "covered", and the covered
+// lanes which passed the depth test. Passed lanes' depth is written when
+// group.write_depth is set; other lanes' memory is never written. The depth
+// test compares the values encoded in the buffer's format.
+template <DepthFormat Format>
+static uint32_t testCoverageAndDepth(const RasterLanes& lanes,
+                                     const RasterGroup& group,
+                                     uint32_t&          covered)
+{
+    using Traits = DepthTraits<Format>;
+    using Type   = typename Traits::Type;
+
+#if defined(RASTER_KERNEL_AVX2)
+    const __m256i lane_bits = _mm256_setr_epi32(
+        1 << 0, 1 << 1, 1 << 2, 1 << 3, 1 << 4, 1 << 5, 1 << 6, 1 << 7);
+    auto toLaneMask = [&lane_bits](uint32_t bits)
+    {
+        return _mm256_cmpeq_epi32(
+            _mm256_and_si256(_mm256_set1_epi32((int)bits), lane_bits),
+            lane_bits);
+    };
+
+    __m256i inside = _mm256_set1_epi32(-1);
+    for (int e = 0; e < 3; ++e)
+    {
+        if (!(group.edge_mask & (1u << e)))
+        {
+            continue;
+        }
+        __m256i value = _mm256_add_epi32(
+            _mm256_set1_epi32(group.edge[e]),
+            _mm256_load_si256((const __m256i*)lanes.edge[e]));
+        inside = _mm256_and_si256(
+            inside,
+            _mm256_cmpgt_epi32(value,
+                               _mm256_set1_epi32(lanes.edge_threshold[e])));
+    }
+    covered = uint32_t(_mm256_movemask_ps(_mm256_castsi256_ps(inside))) &
+              group.lane_mask;
+    if (covered == 0)
+    {
+        return 0;
+    }
+
+    __m256 inv_z = _mm256_add_ps(_mm256_set1_ps(group.inv_z),
+                                 _mm256_load_ps(lanes.inv_z));
+    __m256 z     = _mm256_div_ps(_mm256_set1_ps(1.0f), inv_z);
+
+    uint32_t passed = covered;
+    if constexpr (Format == DepthFormat::D32F)
+    {
+        float* depth = static_cast<float*>(group.depth);
+        if (group.test_depth)
+        {
+            __m256 old = _mm256_maskload_ps(depth, toLaneMask(covered));
+            passed &= uint32_t(
+                _mm256_movemask_ps(_mm256_cmp_ps(z, old, _CMP_LT_OQ)));
+        }
+        if (passed != 0 && group.write_depth)
+        {
+            _mm256_maskstore_ps(depth, toLaneMask(passed), z);
+        }
+        return passed;
+    }
+
+    else
+    {
+        // Encode to unorm, the same way as DepthTraits::encode.
+        z = _mm256_min_ps(_mm256_max_ps(z, _mm256_setzero_ps()),
+                          _mm256_set1_ps(1.0f));
+
+        __m256i value = _mm256_cvttps_epi32(_mm256_add_ps(
+            _mm256_mul_ps(z, _mm256_set1_ps(float(Traits::k_max))),
+            _mm256_set1_ps(0.5f)));
+
+        if constexpr (Format == DepthFormat::D24)
+        {
+            int* depth = static_cast<int*>(group.depth);
+            if (group.test_depth)
+            {
+                __m256i old =
+                    _mm256_maskload_epi32(depth, toLaneMask(covered));
+                passed &= uint32_t(_mm256_movemask_ps(
+                    _mm256_castsi256_ps(_mm256_cmpgt_epi32(old, value))));
+            }
+            if (passed != 0 && group.write_depth)
+            {
+                _mm256_maskstore_epi32(depth, toLaneMask(passed), value);
+            }
+            return passed;
+        }
+        else
+        {
+            // There are no masked 16 bit loads, test the lanes one by one.
+            alignas(32) int32_t values[k_raster_lane_count];
+            _mm256_store_si256((__m256i*)values, value);
+
+            Type* depth = static_cast<Type*>(group.depth);
+            passed      = 0;
+            for (int i = 0; i < k_raster_lane_count; ++i)
+            {
+                if ((covered & (1u << i)) &&
+                    (!group.test_depth || Type(values[i]) < depth[i]))
+                {
+                    passed |= (1u << i);
+                    if (group.write_depth)
+                    {
+                        depth[i] = Type(values[i]);
+                    }
+                }
+            }
+            return passed;
+        }
+    }
+#elif defined(RASTER_KERNEL_SSE2)
+    covered         = 0;
+    uint32_t passed = 0;
+    for (int half = 0; half < k_raster_lane_count; half += 4)
+    {
+        __m128i inside = _mm_set1_epi32(-1);
+        for (int e = 0; e < 3; ++e)
+        {
+            if (!(group.edge_mask & (1u << e)))
+            {
+                continue;
+            }
+            __m128i value = _mm_add_epi32(
+                _mm_set1_epi32(group.edge[e]),
+                _mm_load_si128((const __m128i*)(lanes.edge[e] + half)));
+            inside = _mm_and_si128(
+                inside,
+                _mm_cmpgt_epi32(value,
+                                _mm_set1_epi32(lanes.edge_threshold[e])));
+        }
+        uint32_t half_covered =
+            uint32_t(_mm_movemask_ps(_mm_castsi128_ps(inside))) &
+            (group.lane_mask >> half) & 0xfu;
+        if (half_covered == 0)
+        {
+            continue;
+        }
+
+        __m128 inv_z = _mm_add_ps(_mm_set1_ps(group.inv_z),
+                                  _mm_load_ps(lanes.inv_z + half));
+        __m128 z     = _mm_div_ps(_mm_set1_ps(1.0f), inv_z);
+
+        alignas(16) float z_values[4];
+        _mm_store_ps(z_values, z);
+
+        // Only touch the lanes inside the render area.
+        for (int i = 0; i < 4; ++i)
+        {
+            if (!(half_covered & (1u << i)))
+            {
+                continue;
+            }
+            Type* depth = static_cast<Type*>(group.depth) + half + i;
+            Type  value = Traits::encode(z_values[i]);
+            if (!group.test_depth || value < *depth)
+            {
+                passed |= (1u << (half + i));
+                if (group.write_depth)
+                {
+                    *depth = value;
+                }
+            }
+        }
+        covered |= (half_covered << half);
+    }
+    return passed;
+#else
+    covered         = 0;
+    uint32_t passed = 0;
+    for (int i = 0; i < k_raster_lane_count; ++i)
+    {
+        if (!(group.lane_mask & (1u << i)))
+        {
+            continue;
+        }
+
+        bool is_inside = true;
+        for (int e = 0; e < 3; ++e)
+        {
+            if (group.edge_mask & (1u << e))
+            {
+                is_inside &= (group.edge[e] + lanes.edge[e][i] >
+                              lanes.edge_threshold[e]);
+            }
+        }
+        if (!is_inside)
+        {
+            continue;
+        }
+        covered |= (1u << i);
+
+        Type* depth = static_cast<Type*>(group.depth) + i;
+        Type  value = Traits::encode(1.0f / (group.inv_z + lanes.inv_z[i]));
+        if (!group.test_depth || value < *depth)
+        {
+            passed |= (1u << i);
+            if (group.write_depth)
+            {
+                *depth = value;
+            }
+        }
+    }
+    return passed;
+#endif
+}
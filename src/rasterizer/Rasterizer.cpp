@@ -5,121 +5,647 @@
 
 #include <stb_image_write.h>
 
+// Linear interpolation of the positions and of the vertex shader outputs in
+// varyings, used by clipping.
+static VertexShader::Output lerpOutput(const VertexShader::Output& v0,
+                                       const VertexShader::Output& v1,
+                                       float                       t,
+                                       uint32_t                    varyings)
+{
+    VertexShader::Output output{};
+    output.mvp_position = glm::mix(v0.mvp_position, v1.mvp_position, t);
+    output.mv_position  = glm::mix(v0.mv_position, v1.mv_position, t);
+    if (varyings & FragmentShader::k_varying_mv_normal)
+    {
+        output.mv_normal = glm::mix(v0.mv_normal, v1.mv_normal, t);
+    }
+    if (varyings & FragmentShader::k_varying_color)
+    {
+        output.color = glm::mix(v0.color, v1.color, t);
+    }
+    if (varyings & FragmentShader::k_varying_light_space_pos)
+    {
+        output.light_space_pos =
+            glm::mix(v0.light_space_pos, v1.light_space_pos, t);
+    }
+    if (varyings & (FragmentShader::k_varying_texcoords |
+                    FragmentShader::k_varying_texcoords_derivatives))
+    {
+        output.texcoords = glm::mix(v0.texcoords, v1.texcoords, t);
+    }
+
+    if (varyings & FragmentShader::k_varying_tangent_space_light_pos)
+    {
+        output.tangent_space_light_pos = glm::mix(
+            v0.tangent_space_light_pos, v1.tangent_space_light_pos, t);
+    }
+    if (varyings & FragmentShader::k_varying_tangent_space_view_pos)
+    {
+        output.tangent_space_view_pos = glm::mix(
+            v0.tangent_space_view_pos, v1.tangent_space_view_pos, t);
+    }
+    if (varyings & FragmentShader::k_varying_tangent_space_frag_pos)
+    {
+        output.tangent_space_frag_pos = glm::mix(
+            v0.tangent_space_frag_pos, v1.tangent_space_frag_pos, t);
+    }
+
+    return output;
+}
+
+// The depth only vertices have no varyings.
+static DepthTransform::Output lerpOutput(const DepthTransform::Output& v0,
+                                         const DepthTransform::Output& v1,
+                                         float                         t,
+                                         uint32_t)
+{
+    return { glm::mix(v0.mvp_position, v1.mvp_position, t),
+             glm::mix(v0.depth, v1.depth, t) };
+}
+
+// The depth which is stored and interpolated.
+static float getOutputDepth(const VertexShader::Output& v)
+{
+    return v.mv_position.z;
+}
+static float getOutputDepth(const DepthTransform::Output& v) { return v.depth; }
+
+// Bit i is set when the clip space position is outside of planes[i].
+static uint32_t getOutCode(const glm::vec4& position,
+                           const glm::vec4* planes,
+                           int              plane_count)
+{
+    uint32_t code = 0;
+    for (int i = 0; i < plane_count; ++i)
+    {
+        code |= (glm::dot(planes[i], position) < 0.0f) ? (1u << i) : 0;
+    }
+    return code;
+}
+
+template <DepthFormat Format>
+static void fillDepth(uint8_t* data, size_t count, float depth)
+{
+    using Type = typename DepthTraits<Format>::Type;
+
+    Type* values = reinterpret_cast<Type*>(data);
+    std::fill(values, values + count, DepthTraits<Format>::encode(depth));
+}
+
+static void fillDepth(DepthFormat format,
+                      uint8_t*    data,
+                      size_t      count,
+                      float       depth)
+{
+    switch (format)
+    {
+        case DepthFormat::D24:
+            fillDepth<DepthFormat::D24>(data, count, depth);
+            break;
+        case DepthFormat::D16:
+            fillDepth<DepthFormat::D16>(data, count, depth);
+            break;
+        default: fillDepth<DepthFormat::D32F>(data, count, depth); break;
+    }
+}
+
 bool Rasterizer::init(const Desc& desc)
 {
-    m_width          = desc.width;
-    m_height         = desc.height;
-    m_draw_color     = desc.draw_color;
-    m_draw_depth     = desc.draw_depth;
-    m_enable_4x_msaa = desc.enable_4x_msaa;
-    m_cull_mode      = desc.cull_model;
-
-    // Always set the buffer size 4 times of the resolution, so that the msaa
-    // won't reallocate memory.
-    if (m_draw_color)
+    if (!isValidSampleCount(desc.sample_count) ||
+        desc.width > k_max_viewport_size || desc.height > k_max_viewport_size)
     {
-        m_frame_buffer.resize(m_width * m_height * 4);
-        m_render_result.resize(m_width * m_height);
+        return false;
     }
-    if (m_draw_depth)
+
+    m_width        = desc.width;
+    m_height       = desc.height;
+    m_draw_color   = desc.draw_color;
+    m_draw_depth   = desc.draw_depth;
+    m_sample_count = desc.sample_count;
+    m_cull_mode    = desc.cull_model;
+    m_color_format = desc.color_format;
+    m_srgb         = desc.srgb;
+    m_color_size   = getColorFormatSize(m_color_format);
+    m_depth_format = desc.depth_format;
+    m_depth_size   = getDepthFormatSize(m_depth_format);
+    m_tiled_layout = desc.tiled_layout;
+
+    m_enable_visibility =
+        desc.visibility_buffer && desc.draw_color && desc.draw_depth;
+
+    m_tile_count_x = (m_width + k_tile_size - 1) / k_tile_size;
+    m_tile_count_y = (m_height + k_tile_size - 1) / k_tile_size;
+    m_tile_active.assign(getTileCount(), 0);
+
+    // Every tile starts cleared.
+    m_tile_color_states.assign(getTileCount(), TileColorState::Cleared);
+    m_tile_depth_cleared.assign(getTileCount(), 1);
+    packColor(m_color_format,
+              m_srgb,
+              glm::vec4(0.0f, 0.0f, 0.0f, 1.0f),
+              m_clear_color);
+
+    // Always allocate the msaa buffers, so that msaa can be switched on
+    // without reallocating memory.
+    if (m_draw_color)
     {
-        m_depth_buffer.resize(m_width * m_height * 4);
+        m_color_buffer.resize(getPixelCount() * m_color_size);
+        m_sample_slots.resize(getPixelCount(), k_no_sample_slot);
+        if (m_tiled_layout)
+        {
+            m_linear_color_buffer.resize(m_width * m_height * m_color_size);
+        }
+        m_tile_samples.resize(m_tile_count_x * m_tile_count_y);
     }
+    setSampleCount(m_sample_count);
+
+    // Positions inside the guard band stay in
+    // [-k_guard_band, width + k_guard_band] pixels on the screen.
+    const float guard_band_x = 1.0f + 2.0f * k_guard_band / m_width;
+    const float guard_band_y = 1.0f + 2.0f * k_guard_band / m_height;
+
+    m_clip_planes[0] = glm::vec4(0.0f, 0.0f, 1.0f, 1.0f);  // Near.
+    m_clip_planes[1] = glm::vec4(1.0f, 0.0f, 0.0f, guard_band_x);
+    m_clip_planes[2] = glm::vec4(-1.0f, 0.0f, 0.0f, guard_band_x);
+    m_clip_planes[3] = glm::vec4(0.0f, 1.0f, 0.0f, guard_band_y);
+    m_clip_planes[4] = glm::vec4(0.0f, -1.0f, 0.0f, guard_band_y);
+
+    m_frustum_planes[0] = m_clip_planes[0];
+    m_frustum_planes[1] = glm::vec4(1.0f, 0.0f, 0.0f, 1.0f);
+    m_frustum_planes[2] = glm::vec4(-1.0f, 0.0f, 0.0f, 1.0f);
+    m_frustum_planes[3] = glm::vec4(0.0f, 1.0f, 0.0f, 1.0f);
+    m_frustum_planes[4] = glm::vec4(0.0f, -1.0f, 0.0f, 1.0f);
+
+    m_block_count_x = (m_width + k_block_size - 1) / k_block_size;
+    m_block_count_y = (m_height + k_block_size - 1) / k_block_size;
+    m_hiz_min.resize(m_block_count_x * m_block_count_y);
+    m_hiz_max.resize(m_block_count_x * m_block_count_y);
 
     return true;
 }
 
+void Rasterizer::setSampleCount(int sample_count)
+{
+    if (!isValidSampleCount(sample_count))
+    {
+        return;
+    }
+    m_sample_count = sample_count;
+
+    // The per sample buffers only grow.
+    const size_t size = getPixelCount() * m_sample_count;
+    if (m_draw_depth && m_depth_buffer.size() < size * m_depth_size)
+    {
+        m_depth_buffer.resize(size * m_depth_size);
+    }
+    if (m_enable_visibility && m_visibility_buffer.size() < size)
+    {
+        m_visibility_buffer.resize(size, k_invalid_visibility_id);
+    }
+}
+
 void Rasterizer::exit()
 {}
 
 void Rasterizer::saveImage() const
 {
+    stbi_flip_vertically_on_write(true);
+
+    const std::vector<uint8_t>& color_buffer = getColorBuffer();
+
+    // RGBA8 is already the layout of the image.
+    if (m_color_format == ColorFormat::RGBA8)
+    {
+        stbi_write_png(
+            "screen_shot.png", m_width, m_height, 4, color_buffer.data(), 0);
+        return;
+    }
+
+    // Keep the stored values, which are already sRGB encoded if needed.
     std::vector<stbi_uc> image;
-    for (const glm::vec4& v : m_render_result)
+    for (size_t i = 0; i < color_buffer.size(); i += m_color_size)
     {
+        glm::vec4 v = unpackColor(m_color_format, false, &color_buffer[i]);
         image.push_back(v.r * 255.9f);
         image.push_back(v.g * 255.9f);
         image.push_back(v.b * 255.9f);
         image.push_back(v.a * 255.9f);
     }
 
-    stbi_flip_vertically_on_write(true);
     stbi_write_png("screen_shot.png", m_width, m_height, 4, image.data(), 0);
 }
 
-void Rasterizer::render(const std::vector<Vertex>& vertices,
-                        const std::vector<size_t>& indices,
-                        const VertexShader&        vert_shader,
-                        const FragmentShader&      frag_shader)
+void Rasterizer::renderDepth(const VertexBuffer&   vertices,
+                             const IndexBuffer&    indices,
+                             const DepthTransform& transform)
 {
-    // Run vertex shader on each vertex.
-    std::vector<VertexShader::Output> vertex_after_vs(vertices.size());
-    for (size_t i = 0, n = vertices.size(); i < n; ++i)
-    {
-        vertex_after_vs[i] = vert_shader(vertices[i]);
+    static const FSDepthOnly s_frag_shader;
 
-        // Homo divide.
-        float inv_w = 1.0f / vertex_after_vs[i].mvp_position.w;
-        vertex_after_vs[i].mvp_position.x *= inv_w;
-        vertex_after_vs[i].mvp_position.y *= inv_w;
-        vertex_after_vs[i].mvp_position.z *= inv_w;
+    const uint32_t draw_id = beginDraw(s_frag_shader,
+                                       FSDepthOnly::k_varyings.mask,
+                                       getRasterizeTriangleFunc<FSDepthOnly>(),
+                                       nullptr);
+    DrawCall&      draw    = m_draws[draw_id];
+    draw.vertices.clear();
 
-        // Change to view space.
-        vertex_after_vs[i].mvp_position.x =
-            (vertex_after_vs[i].mvp_position.x + 1.0f) * 0.5f * m_width;
-        vertex_after_vs[i].mvp_position.y =
-            (vertex_after_vs[i].mvp_position.y + 1.0f) * 0.5f * m_height;
-        vertex_after_vs[i].mvp_position.z =
-            (vertex_after_vs[i].mvp_position.z + 1.0f) * 0.5f;
-        vertex_after_vs[i].mvp_position.w = inv_w;
+    m_depth_vertices.resize(vertices.size());
+    tbb::parallel_for(
+        tbb::blocked_range<size_t>(0, vertices.size(), k_vertex_batch_size),
+        [this, &vertices, &transform](tbb::blocked_range<size_t> r)
+        {
+            for (size_t i = r.begin(); i != r.end(); ++i)
+            {
+                m_depth_vertices[i] = transform(vertices.getPosition(i));
+            }
+        });
+
+    setupTriangles(indices, m_depth_vertices, draw);
+    rasterizeDraw(draw, draw_id);
+}
+
+uint32_t Rasterizer::beginDraw(const FragmentShader& frag_shader,
+                               uint32_t              varyings,
+                               RasterizeTriangleFunc rasterize,
+                               ShadePixelFunc        shade_pixel)
+{
+    // In visibility buffer mode every draw of the frame is kept for the
+    // shading in resolve(), otherwise the only slot is reused.
+    const uint32_t draw_id = m_enable_visibility ? m_draw_count++ : 0;
+    if (draw_id >= m_draws.size())
+    {
+        m_draws.resize(draw_id + 1);
     }
+    DrawCall& draw   = m_draws[draw_id];
+    draw.frag_shader = &frag_shader;
+    draw.varyings    = varyings;
+    draw.rasterize   = rasterize;
+    draw.shade_pixel = shade_pixel;
+    return draw_id;
+}
+
+void Rasterizer::assembleTriangles(const IndexBuffer& indices, DrawCall& draw)
+{
+    setupTriangles(indices, draw.vertices, draw);
+}
 
-    // Triangle assemble.
+template <typename Output>
+void Rasterizer::setupTriangles(const IndexBuffer&   indices,
+                                std::vector<Output>& vertex_after_vs,
+                                DrawCall&            draw)
+{
     const size_t triangle_count = indices.size() / 3;
-    for (size_t i = 0; i < triangle_count; ++i)
+    const size_t batch_count =
+        getMin((triangle_count + k_vertex_batch_size - 1) / k_vertex_batch_size,
+               k_max_triangle_batch_count);
+    if (m_triangle_batches.size() < batch_count)
     {
-        processTriangle(vertex_after_vs[indices[i * 3]],
-                        vertex_after_vs[indices[i * 3 + 1]],
-                        vertex_after_vs[indices[i * 3 + 2]],
-                        frag_shader);
+        m_triangle_batches.resize(batch_count);
     }
+    m_triangle_batch_count = batch_count;
+
+    // Clip in homogeneous space, every batch keeps its clipped triangles and
+    // new vertices.
+    tbb::parallel_for(
+        size_t(0),
+        batch_count,
+        [this, &indices, &vertex_after_vs, &draw, triangle_count, batch_count](
+            size_t b)
+        {
+            TriangleBatch& batch = m_triangle_batches[b];
+            batch.indices.clear();
+            batch.getClippedVertices<Output>().clear();
+
+            const size_t lo = triangle_count * b / batch_count;
+            const size_t hi = triangle_count * (b + 1) / batch_count;
+            for (size_t i = lo; i < hi; ++i)
+            {
+                clipTriangle(vertex_after_vs,
+                             draw.varyings,
+                             indices[i * 3],
+                             indices[i * 3 + 1],
+                             indices[i * 3 + 2],
+                             batch);
+            }
+        });
+
+    // The batches are placed one after the other, in the vertex list and in
+    // draw.triangles.
+    size_t vertex_count  = vertex_after_vs.size();
+    size_t clipped_count = 0;
+    for (size_t b = 0; b < batch_count; ++b)
+    {
+        TriangleBatch& batch = m_triangle_batches[b];
+        batch.first_vertex   = vertex_count;
+        batch.first_triangle = clipped_count;
+        vertex_count += batch.getClippedVertices<Output>().size();
+        clipped_count += batch.indices.size() / 3;
+    }
+    vertex_after_vs.resize(vertex_count);
+    draw.triangles.resize(clipped_count);
+
+    tbb::parallel_for(
+        size_t(0),
+        batch_count,
+        [this, &vertex_after_vs](size_t b)
+        {
+            TriangleBatch&             batch = m_triangle_batches[b];
+            const std::vector<Output>& clipped =
+                batch.getClippedVertices<Output>();
+            if (clipped.empty())
+            {
+                return;
+            }
+
+            std::copy(clipped.begin(),
+                      clipped.end(),
+                      vertex_after_vs.begin() + batch.first_vertex);
+            for (uint32_t& idx : batch.indices)
+            {
+                if (idx & k_clipped_vertex)
+                {
+                    idx = uint32_t(batch.first_vertex) +
+                          (idx & ~k_clipped_vertex);
+                }
+            }
+        });
+
+    tbb::parallel_for(
+        tbb::blocked_range<size_t>(
+            0, vertex_after_vs.size(), k_vertex_batch_size),
+        [this, &vertex_after_vs](tbb::blocked_range<size_t> r)
+        {
+            for (size_t i = r.begin(); i != r.end(); ++i)
+            {
+                glm::vec4& position = vertex_after_vs[i].mvp_position;
+
+                // Homo divide.
+                float inv_w = 1.0f / position.w;
+                position.x *= inv_w;
+                position.y *= inv_w;
+                position.z *= inv_w;
+
+                // Change to view space.
+                position.x = (position.x + 1.0f) * 0.5f * m_width;
+                position.y = (position.y + 1.0f) * 0.5f * m_height;
+                position.z = (position.z + 1.0f) * 0.5f;
+                position.w = inv_w;
+            }
+        });
+
+    // Triangle assemble and binning. The culled triangles are only skipped,
+    // so that the triangles keep the submission order.
+    tbb::parallel_for(
+        size_t(0),
+        batch_count,
+        [this, &vertex_after_vs, &draw](size_t b)
+        {
+            TriangleBatch& batch = m_triangle_batches[b];
+            if (batch.tile_bins.size() != getTileCount())
+            {
+                batch.tile_bins.resize(getTileCount());
+            }
+            for (uint32_t tile_idx : batch.active_tiles)
+            {
+                batch.tile_bins[tile_idx].clear();
+            }
+            batch.active_tiles.clear();
+
+            for (size_t i = 0, n = batch.indices.size() / 3; i < n; ++i)
+            {
+                const size_t   triangle_idx = batch.first_triangle + i;
+                TriangleSetup& triangle     = draw.triangles[triangle_idx];
+                if (setupTriangle(vertex_after_vs[batch.indices[i * 3]],
+                                  vertex_after_vs[batch.indices[i * 3 + 1]],
+                                  vertex_after_vs[batch.indices[i * 3 + 2]],
+                                  triangle))
+                {
+                    binTriangle(triangle, uint32_t(triangle_idx), batch);
+                }
+            }
+        });
 }
 
-void Rasterizer::processTriangle(const VertexShader::Output& v0,
-                                 const VertexShader::Output& v1,
-                                 const VertexShader::Output& v2,
-                                 const FragmentShader&       frag_shader)
+void Rasterizer::rasterizeDraw(const DrawCall& draw, uint32_t draw_id)
 {
-    // Triangle direction culling.
-    glm::vec3 eye(0.0f, 0.0f, 0.0f);
-    glm::vec3 p0(v0.mv_position);
-    glm::vec3 p1(v1.mv_position);
-    glm::vec3 p2(v2.mv_position);
-    float     check_dir = glm::dot(glm::cross(p2 - p0, p1 - p0), eye - p0);
-
-    //    2
-    //   / \
-	//  /   \
-	// 1-----0
-    // If the triangle's vertices are given along clockwise order, then the
-    // normal direction should be the same as cr = cross(v02, v01), witch means
-    // normal dot cr should be larger than 0.
+    // Sort-middle: the triangles were put into screen tiles, now rasterize
+    // every tile in parallel. Each tile keeps the submission order of its
+    // triangles.
+    m_active_tiles.clear();
+    for (size_t b = 0; b < m_triangle_batch_count; ++b)
+    {
+        for (uint32_t tile_idx : m_triangle_batches[b].active_tiles)
+        {
+            if (!m_tile_active[tile_idx])
+            {
+                m_tile_active[tile_idx] = 1;
+                m_active_tiles.push_back(tile_idx);
+            }
+        }
+    }
+    for (uint32_t tile_idx : m_active_tiles)
+    {
+        m_tile_active[tile_idx] = 0;
+    }
 
-    if (m_cull_mode == CullMode::All)
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, m_active_tiles.size()),
+                      [this, &draw, draw_id](tbb::blocked_range<size_t> r)
+                      {
+                          for (size_t i = r.begin(); i != r.end(); ++i)
+                          {
+                              rasterizeTile(m_active_tiles[i], draw, draw_id);
+                          }
+                      });
+}
+
+void Rasterizer::resolve()
+{
+    if (!m_draw_color)
     {
         return;
     }
 
-    if (m_cull_mode == CullMode::ClockWise && check_dir > 1e-4f)
+    tbb::parallel_for(
+        tbb::blocked_range<size_t>(0, getTileCount()),
+        [this](tbb::blocked_range<size_t> r)
+        {
+            for (size_t i = r.begin(); i != r.end(); ++i)
+            {
+                TileColorState& state = m_tile_color_states[i];
+                if (state == TileColorState::Written)
+                {
+                    if (m_enable_visibility)
+                    {
+                        shadeVisibilityTile(i);
+                    }
+                    if (m_sample_count > 1)
+                    {
+                        resolveMsaa(i);
+                    }
+                }
+                else if (state == TileColorState::Cleared && !m_tiled_layout)
+                {
+                    // The tile stays filled over the next clears until it
+                    // is drawn to.
+                    fillTileColor(i);
+                    state = TileColorState::ClearFilled;
+                }
+
+                if (m_tiled_layout)
+                {
+                    linearizeTile(i);
+                }
+            }
+        });
+}
+
+template <typename Output>
+void Rasterizer::clipTriangle(const std::vector<Output>& vertices,
+                              uint32_t                   varyings,
+                              uint32_t                   i0,
+                              uint32_t                   i1,
+                              uint32_t                   i2,
+                              TriangleBatch&             batch) const
+{
+    const uint32_t idx[3] = { i0, i1, i2 };
+
+    uint32_t frustum_code = ~0u;
+    uint32_t clip_code    = 0;
+    for (int i = 0; i < 3; ++i)
+    {
+        const glm::vec4& position = vertices[idx[i]].mvp_position;
+        frustum_code &=
+            getOutCode(position, m_frustum_planes, k_clip_plane_count);
+        clip_code |= getOutCode(position, m_clip_planes, k_clip_plane_count);
+    }
+
+    // All the vertices are outside of the same frustum plane.
+    if (frustum_code != 0)
     {
         return;
     }
 
-    if (m_cull_mode == CullMode::CounterClockWise && check_dir < 1e-4)
+    // Most triangles are in front of the camera and inside the guard band.
+    if (clip_code == 0)
     {
+        batch.indices.insert(batch.indices.end(), idx, idx + 3);
         return;
     }
 
+    std::vector<Output>& clipped = batch.getClippedVertices<Output>();
+    auto getVertex = [&vertices, &clipped](uint32_t i) -> const Output&
+    {
+        return (i & k_clipped_vertex) ? clipped[i & ~k_clipped_vertex]
+                                      : vertices[i];
+    };
+
+    // Sutherland-Hodgman, only against the planes which are crossed.
+    uint32_t polygon[2][k_max_clip_vertex];
+    int      count   = 3;
+    int      current = 0;
+    std::copy(idx, idx + 3, polygon[current]);
+
+    for (int p = 0; p < k_clip_plane_count; ++p)
+    {
+        if (!(clip_code & (1u << p)))
+        {
+            continue;
+        }
+
+        const uint32_t* in        = polygon[current];
+        uint32_t*       out       = polygon[current ^ 1];
+        int             out_count = 0;
+        for (int i = 0; i < count; ++i)
+        {
+            const uint32_t a = in[i];
+            const uint32_t b = in[(i + 1) % count];
+            const float    da =
+                glm::dot(m_clip_planes[p], getVertex(a).mvp_position);
+            const float db =
+                glm::dot(m_clip_planes[p], getVertex(b).mvp_position);
+
+            if (da >= 0.0f)
+            {
+                out[out_count++] = a;
+            }
+            if ((da >= 0.0f) != (db >= 0.0f))
+            {
+                // Always interpolate from the inner vertex, so that an edge
+                // shared by two triangles is clipped at the same point.
+                Output v =
+                    (da >= 0.0f) ? lerpOutput(getVertex(a),
+                                              getVertex(b),
+                                              da / (da - db),
+                                              varyings)
+                                 : lerpOutput(getVertex(b),
+                                              getVertex(a),
+                                              db / (db - da),
+                                              varyings);
+                clipped.push_back(v);
+                out[out_count++] =
+                    uint32_t(clipped.size() - 1) | k_clipped_vertex;
+            }
+        }
+
+        current = current ^ 1;
+        count   = out_count;
+        if (count < 3)
+        {
+            return;
+        }
+    }
+
+    // Triangle fan of the convex polygon.
+    for (int i = 1; i + 1 < count; ++i)
+    {
+        batch.indices.push_back(polygon[current][0]);
+        batch.indices.push_back(polygon[current][i]);
+        batch.indices.push_back(polygon[current][i + 1]);
+    }
+}
+
+template <typename Output>
+bool Rasterizer::setupTriangle(const Output&  v0,
+                               const Output&  v1,
+                               const Output&  v2,
+                               TriangleSetup& setup) const
+{
+    constexpr bool k_has_view_position =
+        std::is_same_v<Output, VertexShader::Output>;
+
+    if (m_cull_mode == CullMode::All)
+    {
+        return false;
+    }
+
+    // Triangle direction culling. The depth only vertices have no view
+    // position, they are culled on the screen below.
+    if constexpr (k_has_view_position)
+    {
+        glm::vec3 eye(0.0f, 0.0f, 0.0f);
+        glm::vec3 p0(v0.mv_position);
+        glm::vec3 p1(v1.mv_position);
+        glm::vec3 p2(v2.mv_position);
+        float check_dir = glm::dot(glm::cross(p2 - p0, p1 - p0), eye - p0);
+
+        //    2
+        //   / \
+        //  /   \
+        // 1-----0
+        // If the triangle's vertices are given along clockwise order, then the
+        // normal direction should be the same as cr = cross(v02, v01), witch
+        // means normal dot cr should be larger than 0.
+
+        if (m_cull_mode == CullMode::ClockWise && check_dir > 1e-4f)
+        {
+            return false;
+        }
+
+        if (m_cull_mode == CullMode::CounterClockWise && check_dir < 1e-4)
+        {
+            return false;
+        }
+    }
+
 
     // Viewport transfromation.
     // x -> [0, width], y -> [0, height], z -> [0, 1]
@@ -136,385 +662,507 @@ void Rasterizer::processTriangle(const VertexShader::Output& v0,
     if (x_min > (float)m_width || x_max < 0.0f || y_min > (float)m_height ||
         y_max < 0.0f)
     {
-        return;
+        return false;
+    }
+
+    // Clipping keeps the positions inside the guard band, this also rejects
+    // NaN positions.
+    if (!(x_min > -k_max_screen_coord && x_max < k_max_screen_coord &&
+          y_min > -k_max_screen_coord && y_max < k_max_screen_coord))
+    {
+        return false;
+    }
+
+
+    // Snap to 28.4 fixed point.
+    const Output* v[3] = { &v0, &v1, &v2 };
+    int32_t       x[3];
+    int32_t       y[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        x[i] = (int32_t)std::lround(v[i]->mvp_position.x * k_subpixel_scale);
+        y[i] = (int32_t)std::lround(v[i]->mvp_position.y * k_subpixel_scale);
+    }
+
+    int64_t area2 = int64_t(x[1] - x[0]) * (y[2] - y[0]) -
+                    int64_t(x[2] - x[0]) * (y[1] - y[0]);
+    if (area2 == 0)
+    {
+        return false;
     }
 
+    // The same culling on the screen, area2 is positive for the triangles
+    // which are counter clockwise with y up.
+    if constexpr (!k_has_view_position)
+    {
+        if ((m_cull_mode == CullMode::ClockWise && area2 > 0) ||
+            (m_cull_mode == CullMode::CounterClockWise && area2 < 0))
+        {
+            return false;
+        }
+    }
 
-    // Rasterize triangle.
-    const int x_lo = getMax((int)x_min, 0);
-    const int x_hi = getMin((int)x_max, m_width - 1);
-    const int y_lo = getMax((int)y_min, 0);
-    const int y_hi = getMin((int)y_max, m_height - 1);
+    // Make the edge functions positive inside the triangle.
+    if (area2 < 0)
+    {
+        std::swap(v[1], v[2]);
+        std::swap(x[1], x[2]);
+        std::swap(y[1], y[2]);
+        area2 = -area2;
+    }
 
-    if (m_enable_4x_msaa)
+    for (int i = 0; i < 3; ++i)
     {
-        tbb::parallel_for(
-            tbb::blocked_range<int>(y_lo, y_hi),
-            [x_lo, x_hi, this, v0, v1, v2, &frag_shader](
-                tbb::blocked_range<int> r)
+        const int p = (i + 1) % 3;
+        const int q = (i + 2) % 3;
+
+        EdgeFunction& edge = setup.edge[i];
+        edge.a             = y[p] - y[q];
+        edge.b             = x[q] - x[p];
+        edge.c = -(int64_t(edge.a) * x[p] + int64_t(edge.b) * y[p]);
+
+        // Top-left fill rule, with y pointing up on the screen.
+        bool is_top_left = (edge.a > 0) || (edge.a == 0 && edge.b < 0);
+        edge.bias        = is_top_left ? 0 : 1;
+
+        if constexpr (k_has_view_position)
+        {
+            setup.v[i] = v[i];
+        }
+        else
+        {
+            setup.v[i] = nullptr;
+        }
+        setup.inv_z[i] = 1.0f / getOutputDepth(*v[i]);
+    }
+    setup.inv_area = float(1.0 / (double)area2);
+    const float z[3] = { getOutputDepth(v0),
+                         getOutputDepth(v1),
+                         getOutputDepth(v2) };
+    setup.z_min =
+        getDepthValue(m_depth_format, std::min({ z[0], z[1], z[2] }));
+    setup.z_max =
+        getDepthValue(m_depth_format, std::max({ z[0], z[1], z[2] }));
+    setup.inv_z_dx = (setup.edge[1].a * (setup.inv_z[1] - setup.inv_z[0]) +
+                      setup.edge[2].a * (setup.inv_z[2] - setup.inv_z[0])) *
+                     setup.inv_area;
+    setup.inv_z_dy = (setup.edge[1].b * (setup.inv_z[1] - setup.inv_z[0]) +
+                      setup.edge[2].b * (setup.inv_z[2] - setup.inv_z[0])) *
+                     setup.inv_area;
+
+    // Shrink the bounding box to the pixels which have a sample inside it,
+    // this culls the triangles falling between the samples.
+    const SamplePosition* sample_pos = getSamplePattern(m_sample_count);
+    int                   sample_x_lo = k_subpixel_scale;
+    int                   sample_x_hi = 0;
+    int                   sample_y_lo = k_subpixel_scale;
+    int                   sample_y_hi = 0;
+    for (int i = 0; i < m_sample_count; ++i)
+    {
+        sample_x_lo = getMin(sample_x_lo, sample_pos[i][0]);
+        sample_x_hi = getMax(sample_x_hi, sample_pos[i][0]);
+        sample_y_lo = getMin(sample_y_lo, sample_pos[i][1]);
+        sample_y_hi = getMax(sample_y_hi, sample_pos[i][1]);
+    }
+
+    const int32_t fx_min = std::min({ x[0], x[1], x[2] });
+    const int32_t fx_max = std::max({ x[0], x[1], x[2] });
+    const int32_t fy_min = std::min({ y[0], y[1], y[2] });
+    const int32_t fy_max = std::max({ y[0], y[1], y[2] });
+
+    setup.x_lo = getMax(
+        (fx_min - sample_x_hi + k_subpixel_scale - 1) >> k_subpixel_bits, 0);
+    setup.x_hi =
+        getMin((fx_max - sample_x_lo) >> k_subpixel_bits, m_width - 1);
+    setup.y_lo = getMax(
+        (fy_min - sample_y_hi + k_subpixel_scale - 1) >> k_subpixel_bits, 0);
+    setup.y_hi =
+        getMin((fy_max - sample_y_lo) >> k_subpixel_bits, m_height - 1);
+
+    return setup.x_lo <= setup.x_hi && setup.y_lo <= setup.y_hi;
+}
+
+void Rasterizer::binTriangle(const TriangleSetup& triangle,
+                             uint32_t             triangle_idx,
+                             TriangleBatch&       batch) const
+{
+    const int tx_lo = triangle.x_lo / k_tile_size;
+    const int tx_hi = triangle.x_hi / k_tile_size;
+    const int ty_lo = triangle.y_lo / k_tile_size;
+    const int ty_hi = triangle.y_hi / k_tile_size;
+
+    for (int ty = ty_lo; ty <= ty_hi; ++ty)
+    {
+        for (int tx = tx_lo; tx <= tx_hi; ++tx)
+        {
+            size_t tile_idx = size_t(ty * m_tile_count_x + tx);
+            if (batch.tile_bins[tile_idx].empty())
             {
-                for (int y = r.begin(); y <= r.end(); ++y)
-                {
-                    for (int x = x_lo; x <= x_hi; ++x)
-                    {
-                        // The pixel center's interpolating results.
-                        // Used when the triangle covers the center.
-                        auto center_param =
-                            getInterpolateParam(x + 0.5f,
-                                                y + 0.5f,
-                                                v0.mvp_position,
-                                                v1.mvp_position,
-                                                v2.mvp_position);
-
-                        bool done_fs =
-                            false;  // The flag to assure fragment shader will
-                                    // be call only once in one pixel.
-                        glm::vec4 fs_color{};  // Record the fs result.
-                        for (int i = 0; i < 4; ++i)
-                        {
-                            float curr_x = x + k_msaa_delta[i][0];
-                            float curr_y = y + k_msaa_delta[i][1];
-
-                            auto [alpha, beta, gamma] =
-                                getInterpolateParam(curr_x,
-                                                    curr_y,
-                                                    v0.mvp_position,
-                                                    v1.mvp_position,
-                                                    v2.mvp_position);
-
-                            // Check if is inside the triangle.
-                            if (alpha < 0.0f || beta < 0.0f || gamma < 0.0f)
-                                continue;
-
-                            // Interpolate depth.
-                            float z0_ = alpha / v0.mv_position.z;
-                            float z1_ = beta / v1.mv_position.z;
-                            float z2_ = gamma / v2.mv_position.z;
-                            float zt  = 1.0f / (z0_ + z1_ + z2_);
-
-                            size_t idx = ((y * m_width + x) << 2) + i;
-
-                            // z-test.
-                            if (zt >= m_depth_buffer[idx])
-                            {
-                                continue;
-                            }
-                            if (m_draw_depth)
-                            {
-                                m_depth_buffer[idx] = zt;
-                            }
-
-                            if (m_draw_color)
-                            {
-                                if (!done_fs)
-                                {
-                                    FragmentShader::Input input{};
-
-                                    if (std::get<0>(center_param) < 0 ||
-                                        std::get<1>(center_param) < 0 ||
-                                        std::get<2>(center_param) < 0)
-                                    {
-                                        input.mv_position =
-                                            interpolate(v0.mv_position,
-                                                        v1.mv_position,
-                                                        v2.mv_position,
-                                                        z0_,
-                                                        z1_,
-                                                        z2_,
-                                                        zt);
-                                        input.mv_normal = glm::normalize(
-                                            interpolate(v0.mv_normal,
-                                                        v1.mv_normal,
-                                                        v2.mv_normal,
-                                                        z0_,
-                                                        z1_,
-                                                        z2_,
-                                                        zt));
-                                        input.light_space_pos =
-                                            interpolate(v0.light_space_pos,
-                                                        v1.light_space_pos,
-                                                        v2.light_space_pos,
-                                                        z0_,
-                                                        z1_,
-                                                        z2_,
-                                                        zt);
-                                        input.color = interpolate(v0.color,
-                                                                  v1.color,
-                                                                  v2.color,
-                                                                  z0_,
-                                                                  z1_,
-                                                                  z2_,
-                                                                  zt);
-                                        input.texcoords =
-                                            interpolate(v0.texcoords,
-                                                        v1.texcoords,
-                                                        v2.texcoords,
-                                                        z0_,
-                                                        z1_,
-                                                        z2_,
-                                                        zt);
-
-                                        input.tangent_space_light_pos =
-                                            interpolate(
-                                                v0.tangent_space_light_pos,
-                                                v1.tangent_space_light_pos,
-                                                v2.tangent_space_light_pos,
-                                                z0_,
-                                                z1_,
-                                                z2_,
-                                                zt);
-                                        input.tangent_space_view_pos =
-                                            interpolate(
-                                                v0.tangent_space_view_pos,
-                                                v1.tangent_space_view_pos,
-                                                v2.tangent_space_view_pos,
-                                                z0_,
-                                                z1_,
-                                                z2_,
-                                                zt);
-                                        input.tangent_space_frag_pos =
-                                            interpolate(
-                                                v0.tangent_space_frag_pos,
-                                                v1.tangent_space_frag_pos,
-                                                v2.tangent_space_frag_pos,
-                                                z0_,
-                                                z1_,
-                                                z2_,
-                                                zt);
-                                    }
-                                    else
-                                    {
-                                        // Interpolate center's depth.
-                                        float z0__ = std::get<0>(center_param) /
-                                                     v0.mv_position.z;
-                                        float z1__ = std::get<1>(center_param) /
-                                                     v1.mv_position.z;
-                                        float z2__ = std::get<2>(center_param) /
-                                                     v2.mv_position.z;
-                                        float zt_ = 1.0f / (z0__ + z1__ + z2__);
-
-                                        input.mv_position =
-                                            interpolate(v0.mv_position,
-                                                        v1.mv_position,
-                                                        v2.mv_position,
-                                                        z0__,
-                                                        z1__,
-                                                        z2__,
-                                                        zt_);
-                                        input.mv_normal = glm::normalize(
-                                            interpolate(v0.mv_normal,
-                                                        v1.mv_normal,
-                                                        v2.mv_normal,
-                                                        z0__,
-                                                        z1__,
-                                                        z2__,
-                                                        zt_));
-                                        input.light_space_pos =
-                                            interpolate(v0.light_space_pos,
-                                                        v1.light_space_pos,
-                                                        v2.light_space_pos,
-                                                        z0__,
-                                                        z1__,
-                                                        z2__,
-                                                        zt_);
-                                        input.color = interpolate(v0.color,
-                                                                  v1.color,
-                                                                  v2.color,
-                                                                  z0__,
-                                                                  z1__,
-                                                                  z2__,
-                                                                  zt_);
-                                        input.texcoords =
-                                            interpolate(v0.texcoords,
-                                                        v1.texcoords,
-                                                        v2.texcoords,
-                                                        z0__,
-                                                        z1__,
-                                                        z2__,
-                                                        zt_);
-
-                                        input.tangent_space_light_pos =
-                                            interpolate(
-                                                v0.tangent_space_light_pos,
-                                                v1.tangent_space_light_pos,
-                                                v2.tangent_space_light_pos,
-                                                z0__,
-                                                z1__,
-                                                z2__,
-                                                zt_);
-                                        input.tangent_space_view_pos =
-                                            interpolate(
-                                                v0.tangent_space_view_pos,
-                                                v1.tangent_space_view_pos,
-                                                v2.tangent_space_view_pos,
-                                                z0__,
-                                                z1__,
-                                                z2__,
-                                                zt_);
-                                        input.tangent_space_frag_pos =
-                                            interpolate(
-                                                v0.tangent_space_frag_pos,
-                                                v1.tangent_space_frag_pos,
-                                                v2.tangent_space_frag_pos,
-                                                z0__,
-                                                z1__,
-                                                z2__,
-                                                zt_);
-                                    }
-
-                                    fs_color = frag_shader(input);
-
-                                    done_fs = true;
-                                }
-
-                                m_frame_buffer[idx] = fs_color;
-                            }
-                        }
-                    }
-                }
-            });
+                batch.active_tiles.push_back((uint32_t)tile_idx);
+            }
+            batch.tile_bins[tile_idx].push_back(triangle_idx);
+        }
+    }
+}
+
+void Rasterizer::rasterizeTile(size_t          tile_idx,
+                               const DrawCall& draw,
+                               uint32_t        draw_id)
+{
+    const int tile_x_lo = int(tile_idx % m_tile_count_x) * k_tile_size;
+    const int tile_y_lo = int(tile_idx / m_tile_count_x) * k_tile_size;
+    const int tile_x_hi = getMin(tile_x_lo + k_tile_size, m_width) - 1;
+    const int tile_y_hi = getMin(tile_y_lo + k_tile_size, m_height) - 1;
+
+    prepareTile(tile_idx);
+
+    // The farthest depth of the tile, refreshed when a triangle lowered it.
+    float tile_max_depth =
+        getMaxDepth(tile_x_lo, tile_x_hi, tile_y_lo, tile_y_hi);
+    bool  is_hiz_changed = false;
 
-        tbb::parallel_for(
-            tbb::blocked_range<int>(y_lo, y_hi),
-            [x_lo, x_hi, this](tbb::blocked_range<int> r)
+    for (size_t b = 0; b < m_triangle_batch_count; ++b)
+    {
+        for (uint32_t triangle_idx : m_triangle_batches[b].tile_bins[tile_idx])
+        {
+            const TriangleSetup& triangle = draw.triangles[triangle_idx];
+
+            if (is_hiz_changed)
             {
-                for (int y = r.begin(); y <= r.end(); ++y)
+                tile_max_depth =
+                    getMaxDepth(tile_x_lo, tile_x_hi, tile_y_lo, tile_y_hi);
+                is_hiz_changed = false;
+            }
+            if (triangle.z_min >= tile_max_depth)
+            {
+                continue;
+            }
+
+            const int x_lo = getMax(triangle.x_lo, tile_x_lo);
+            const int x_hi = getMin(triangle.x_hi, tile_x_hi);
+            const int y_lo = getMax(triangle.y_lo, tile_y_lo);
+            const int y_hi = getMin(triangle.y_hi, tile_y_hi);
+
+            is_hiz_changed =
+                (this->*draw.rasterize)(triangle,
+                                        x_lo,
+                                        x_hi,
+                                        y_lo,
+                                        y_hi,
+                                        *draw.frag_shader,
+                                        (uint64_t(draw_id) << 32) |
+                                            triangle_idx);
+        }
+    }
+}
+
+void Rasterizer::prepareTile(size_t tile_idx)
+{
+    const size_t sample_count = size_t(m_sample_count);
+
+    if (m_tile_depth_cleared[tile_idx])
+    {
+        const int bx_lo = int(tile_idx % m_tile_count_x) * k_tile_size;
+        const int by_lo = int(tile_idx / m_tile_count_x) * k_tile_size;
+        const int bx_hi = getMin(bx_lo + k_tile_size, m_width) - 1;
+        const int by_hi = getMin(by_lo + k_tile_size, m_height) - 1;
+
+        const float max_depth =
+            getDepthValue(m_depth_format, k_max_relative_depth);
+        for (int by = by_lo; by <= by_hi; by += k_block_size)
+        {
+            for (int bx = bx_lo; bx <= bx_hi; bx += k_block_size)
+            {
+                m_hiz_min[getBlockIdx(bx, by)] = max_depth;
+                m_hiz_max[getBlockIdx(bx, by)] = max_depth;
+            }
+        }
+
+        if (m_draw_depth)
+        {
+            forEachTileSpan(
+                tile_idx,
+                [this, sample_count](size_t first, size_t count)
                 {
-                    for (int x = x_lo; x <= x_hi; ++x)
-                    {
-                        size_t idx = (size_t(y * m_width + x) << 2);
-                        m_render_result[idx >> 2] =
-                            0.25f *
-                            (m_frame_buffer[idx] + m_frame_buffer[idx + 1] +
-                             m_frame_buffer[idx + 2] + m_frame_buffer[idx + 3]);
-                    }
-                }
-            });
+                    fillDepth(m_depth_format,
+                              &m_depth_buffer[first * sample_count *
+                                              m_depth_size],
+                              count * sample_count,
+                              k_max_relative_depth);
+                });
+        }
+        m_tile_depth_cleared[tile_idx] = 0;
     }
-    else
+
+    TileColorState& state = m_tile_color_states[tile_idx];
+    if (m_draw_color && state != TileColorState::Written)
     {
-        tbb::parallel_for(
-            tbb::blocked_range<int>(y_lo, y_hi),
-            [x_lo, x_hi, this, v0, v1, v2, &frag_shader](
-                tbb::blocked_range<int> r)
+        if (state == TileColorState::Cleared)
+        {
+            fillTileColor(tile_idx);
+        }
+
+        forEachTileSpan(
+            tile_idx,
+            [this, sample_count](size_t first, size_t count)
             {
-                for (int y = r.begin(); y <= r.end(); ++y)
+                std::fill_n(&m_sample_slots[first], count, k_no_sample_slot);
+                if (m_enable_visibility)
                 {
-                    for (int x = x_lo; x <= x_hi; ++x)
+                    std::fill_n(&m_visibility_buffer[first * sample_count],
+                                count * sample_count,
+                                k_invalid_visibility_id);
+                }
+            });
+        state = TileColorState::Written;
+    }
+}
+
+void Rasterizer::fillTileColor(size_t tile_idx)
+{
+    forEachTileSpan(tile_idx,
+                    [this](size_t first, size_t count)
                     {
-                        if (!isInsideTriangle(x + 0.5f,
-                                              y + 0.5f,
-                                              v0.mvp_position,
-                                              v1.mvp_position,
-                                              v2.mvp_position))
+                        for (size_t i = first; i < first + count; ++i)
                         {
-                            continue;
+                            std::memcpy(&m_color_buffer[i * m_color_size],
+                                        m_clear_color,
+                                        m_color_size);
                         }
+                    });
+}
 
+glm::vec2 Rasterizer::getTexcoords(const TriangleSetup& setup,
+                                   int                  x,
+                                   int                  y) const
+{
+    const int64_t px = (int64_t(x) << k_subpixel_bits) + k_subpixel_scale / 2;
+    const int64_t py = (int64_t(y) << k_subpixel_bits) + k_subpixel_scale / 2;
 
-                        // Interpolate alpha/beta/gamma.
-                        auto params = getInterpolateParam(x + 0.5f,
-                                                          y + 0.5f,
-                                                          v0.mvp_position,
-                                                          v1.mvp_position,
-                                                          v2.mvp_position);
+    float beta  = float(setup.edge[1].evaluate(px, py)) * setup.inv_area;
+    float gamma = float(setup.edge[2].evaluate(px, py)) * setup.inv_area;
+    float alpha = 1.0f - beta - gamma;
 
-                        auto [alpha, beta, gamma] = params;
+    float z0_ = alpha * setup.inv_z[0];
+    float z1_ = beta * setup.inv_z[1];
+    float z2_ = gamma * setup.inv_z[2];
+    float zt  = 1.0f / (z0_ + z1_ + z2_);
 
+    return interpolate(setup.v[0]->texcoords,
+                       setup.v[1]->texcoords,
+                       setup.v[2]->texcoords,
+                       z0_,
+                       z1_,
+                       z2_,
+                       zt);
+}
 
-                        // Interpolate depth.
-                        float z0_ = alpha / v0.mv_position.z;
-                        float z1_ = beta / v1.mv_position.z;
-                        float z2_ = gamma / v2.mv_position.z;
-                        float zt  = 1.0f / (z0_ + z1_ + z2_);
+void Rasterizer::writeColor(int              x,
+                            int              y,
+                            uint32_t         samples,
+                            const glm::vec4& color)
+{
+    const size_t pixel_idx = getIdx(x, y);
+    if (m_sample_count == 1)
+    {
+        storeColor(pixel_idx, color);
+        return;
+    }
 
+    // A fully covered pixel keeps a single color.
+    uint32_t& slot = m_sample_slots[pixel_idx];
+    if (samples == (1u << m_sample_count) - 1)
+    {
+        storeColor(pixel_idx, color);
+        if (slot != k_no_sample_slot)
+        {
+            slot &= ~k_sample_slot_used;
+        }
+        return;
+    }
 
-                        // Depth test.
-                        size_t idx = getIdx(x, y);
-                        if (zt >= m_depth_buffer[idx])
-                        {
-                            continue;
-                        }
-                        if (m_draw_depth)
-                        {
-                            m_depth_buffer[idx] = zt;
-                        }
+    // Otherwise the pixel's samples are stored in its tile's sample pool.
+    // The slot is kept when the pixel becomes fully covered again, so that
+    // the pool never has more than one slot per pixel.
+    TileSamples& pool =
+        m_tile_samples[(y / k_tile_size) * m_tile_count_x + x / k_tile_size];
+    if (slot == k_no_sample_slot)
+    {
+        slot = uint32_t(pool.pixels.size()) << 1;
+        pool.pixels.push_back(uint32_t(pixel_idx));
+        pool.colors.resize(pool.colors.size() + m_sample_count);
+    }
 
+    glm::vec4* pixel_colors = &pool.colors[(slot >> 1) * m_sample_count];
+    if (!(slot & k_sample_slot_used))
+    {
+        std::fill(pixel_colors,
+                  pixel_colors + m_sample_count,
+                  loadColor(pixel_idx));
+        slot |= k_sample_slot_used;
+    }
+    for (int i = 0; i < m_sample_count; ++i)
+    {
+        if (samples & (1u << i))
+        {
+            pixel_colors[i] = color;
+        }
+    }
+}
 
-                        // Calculate pixel.
-                        if (m_draw_color)
-                        {
-                            FragmentShader::Input input{};
-                            input.mv_position = interpolate(v0.mv_position,
-                                                            v1.mv_position,
-                                                            v2.mv_position,
-                                                            z0_,
-                                                            z1_,
-                                                            z2_,
-                                                            zt);
-                            input.mv_normal =
-                                glm::normalize(interpolate(v0.mv_normal,
-                                                           v1.mv_normal,
-                                                           v2.mv_normal,
-                                                           z0_,
-                                                           z1_,
-                                                           z2_,
-                                                           zt));
-                            input.light_space_pos =
-                                interpolate(v0.light_space_pos,
-                                            v1.light_space_pos,
-                                            v2.light_space_pos,
-                                            z0_,
-                                            z1_,
-                                            z2_,
-                                            zt);
-                            input.color     = interpolate(v0.color,
-                                                      v1.color,
-                                                      v2.color,
-                                                      z0_,
-                                                      z1_,
-                                                      z2_,
-                                                      zt);
-                            input.texcoords = interpolate(v0.texcoords,
-                                                          v1.texcoords,
-                                                          v2.texcoords,
-                                                          z0_,
-                                                          z1_,
-                                                          z2_,
-                                                          zt);
-
-                            input.tangent_space_light_pos =
-                                interpolate(v0.tangent_space_light_pos,
-                                            v1.tangent_space_light_pos,
-                                            v2.tangent_space_light_pos,
-                                            z0_,
-                                            z1_,
-                                            z2_,
-                                            zt);
-                            ;
-                            input.tangent_space_view_pos =
-                                interpolate(v0.tangent_space_view_pos,
-                                            v1.tangent_space_view_pos,
-                                            v2.tangent_space_view_pos,
-                                            z0_,
-                                            z1_,
-                                            z2_,
-                                            zt);
-                            ;
-                            input.tangent_space_frag_pos =
-                                interpolate(v0.tangent_space_frag_pos,
-                                            v1.tangent_space_frag_pos,
-                                            v2.tangent_space_frag_pos,
-                                            z0_,
-                                            z1_,
-                                            z2_,
-                                            zt);
-                            ;
-
-                            m_render_result[idx] = frag_shader(input);
-                        }
-                    }
+void Rasterizer::shadeVisibilityTile(size_t tile_idx)
+{
+    const int sample_count = getSampleCount();
+
+    const int tile_x_lo = int(tile_idx % m_tile_count_x) * k_tile_size;
+    const int tile_y_lo = int(tile_idx / m_tile_count_x) * k_tile_size;
+    const int tile_x_hi = getMin(tile_x_lo + k_tile_size, m_width) - 1;
+    const int tile_y_hi = getMin(tile_y_lo + k_tile_size, m_height) - 1;
+
+    for (int y = tile_y_lo; y <= tile_y_hi; ++y)
+    {
+        for (int x = tile_x_lo; x <= tile_x_hi; ++x)
+        {
+            const uint64_t* ids =
+                &m_visibility_buffer[getIdx(x, y) * sample_count];
+
+            // Shade once for every triangle visible in the pixel.
+            uint32_t shaded = 0;
+            for (int i = 0; i < sample_count; ++i)
+            {
+                if ((shaded & (1u << i)) || ids[i] == k_invalid_visibility_id)
+                {
+                    continue;
                 }
-            });
+
+                uint32_t samples = 0;
+                for (int j = i; j < sample_count; ++j)
+                {
+                    samples |= (ids[j] == ids[i]) ? (1u << j) : 0;
+                }
+                shaded |= samples;
+
+                const DrawCall&      draw  = m_draws[ids[i] >> 32];
+                const TriangleSetup& setup = draw.triangles[uint32_t(ids[i])];
+                writeColor(x,
+                           y,
+                           samples,
+                           (this->*draw.shade_pixel)(
+                               setup, x, y, samples, *draw.frag_shader));
+            }
+        }
+    }
+
+}
+
+void Rasterizer::linearizeTile(size_t tile_idx)
+{
+    const int tile_x_lo = int(tile_idx % m_tile_count_x) * k_tile_size;
+    const int tile_y_lo = int(tile_idx / m_tile_count_x) * k_tile_size;
+    const int tile_x_hi = getMin(tile_x_lo + k_tile_size, m_width) - 1;
+    const int tile_y_hi = getMin(tile_y_lo + k_tile_size, m_height) - 1;
+
+    const bool is_cleared =
+        (m_tile_color_states[tile_idx] == TileColorState::Cleared);
+
+    for (int y = tile_y_lo; y <= tile_y_hi; ++y)
+    {
+        uint8_t* dst =
+            &m_linear_color_buffer[(size_t(y) * m_width + tile_x_lo) *
+                                   m_color_size];
+
+        // The tiled buffer of a cleared tile is stale.
+        if (is_cleared)
+        {
+            for (int x = tile_x_lo; x <= tile_x_hi; ++x)
+            {
+                std::memcpy(dst, m_clear_color, m_color_size);
+                dst += m_color_size;
+            }
+            continue;
+        }
+
+        // A row of a block is contiguous in the tiled layout.
+        for (int x = tile_x_lo; x <= tile_x_hi; x += k_block_size)
+        {
+            const int count = getMin(k_block_size, tile_x_hi + 1 - x);
+            std::memcpy(dst,
+                        &m_color_buffer[getIdx(x, y) * m_color_size],
+                        count * m_color_size);
+            dst += count * m_color_size;
+        }
+    }
+}
+
+void Rasterizer::resolveMsaa(size_t tile_idx)
+{
+    // Fully covered pixels already hold their final color.
+    const TileSamples& pool = m_tile_samples[tile_idx];
+    const float        scale = 1.0f / float(m_sample_count);
+    for (size_t i = 0, n = pool.pixels.size(); i < n; ++i)
+    {
+        const uint32_t pixel_idx = pool.pixels[i];
+        if (!(m_sample_slots[pixel_idx] & k_sample_slot_used))
+        {
+            continue;
+        }
+
+        const glm::vec4* pixel_colors = &pool.colors[i * m_sample_count];
+        glm::vec4        sum(0.0f);
+        for (int j = 0; j < m_sample_count; ++j)
+        {
+            sum += pixel_colors[j];
+        }
+        storeColor(pixel_idx, scale * sum);
+    }
+}
+
+float Rasterizer::getMaxDepth(int x_lo, int x_hi, int y_lo, int y_hi) const
+{
+    float max_depth = 0.0f;
+    for (int by = y_lo / k_block_size; by <= y_hi / k_block_size; ++by)
+    {
+        for (int bx = x_lo / k_block_size; bx <= x_hi / k_block_size; ++bx)
+        {
+            max_depth =
+                getMax(max_depth, m_hiz_max[by * m_block_count_x + bx]);
+        }
+    }
+    return max_depth;
+}
+
+float Rasterizer::computeBlockMaxDepth(int bx, int by) const
+{
+    switch (m_depth_format)
+    {
+        case DepthFormat::D24:
+            return computeBlockMaxDepth<DepthFormat::D24>(bx, by);
+        case DepthFormat::D16:
+            return computeBlockMaxDepth<DepthFormat::D16>(bx, by);
+        default: return computeBlockMaxDepth<DepthFormat::D32F>(bx, by);
+    }
+}
+
+template <DepthFormat Format>
+float Rasterizer::computeBlockMaxDepth(int bx, int by) const
+{
+    using Type = typename DepthTraits<Format>::Type;
+
+    const int    sample_count = getSampleCount();
+    const int    x_hi         = getMin(bx + k_block_size, m_width);
+    const int    y_hi         = getMin(by + k_block_size, m_height);
+    const size_t row_size     = size_t(x_hi - bx) * sample_count;
+
+    Type max_depth = 0;
+    for (int y = by; y < y_hi; ++y)
+    {
+        const Type* depth =
+            reinterpret_cast<const Type*>(m_depth_buffer.data()) +
+            getIdx(bx, y) * sample_count;
+        for (size_t i = 0; i < row_size; ++i)
+        {
+            max_depth = getMax(max_depth, depth[i]);
+        }
     }
+    return float(max_depth);
 }
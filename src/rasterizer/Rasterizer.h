@@ -1,16 +1,23 @@
 #pragma once
+#include <cstdint>
 #include <memory>
 #include <numeric>
 #include <string>
 #include <tuple>
+#include <type_traits>
 #include <vector>
 
 #include <glm/glm.hpp>
 
+#include "ColorFormat.hpp"
+#include "DepthFormat.hpp"
 #include "FragmentShader.hpp"
+#include "RasterKernel.hpp"
+#include "TiledLayout.hpp"
 #include "VertexShader.hpp"
 #include "geometry/Camera.h"
 #include "geometry/Vertex.h"
+#include "geometry/VertexBuffer.h"
 #include "utils/Utils.hpp"
 
 class Rasterizer
@@ -32,19 +39,133 @@ public:
         bool draw_color = true;
         bool draw_depth = true;
 
-        bool enable_4x_msaa = false;
+        // Msaa samples per pixel: 1, 2, 4, 8 or 16.
+        int sample_count = 1;
+
+        // Storage of the color buffer, the colors are encoded to sRGB when
+        // srgb is set.
+        ColorFormat color_format = ColorFormat::RGBA32F;
+        bool        srgb         = false;
+
+        DepthFormat depth_format = DepthFormat::D32F;
+
+        // Store the render targets in the tiled layout of TiledLayout.hpp.
+        // The color buffer is converted to rows in resolve().
+        bool tiled_layout = false;
+
+        // Rasterize only depth and triangle ids in render(), and shade every
+        // pixel once in resolve(). Needs draw_color and draw_depth. The
+        // fragment shaders must stay alive and unchanged until resolve().
+        bool visibility_buffer = false;
 
         CullMode cull_model = CullMode::None;
     };
 
 private:
-    static constexpr float k_msaa_delta[][2] = {
-        {0.375f, 0.125f},
-        {0.875f, 0.375f},
-        {0.125f, 0.625f},
-        {0.625f, 0.875f},
+    // Vertices and triangles are transformed in parallel batches of this
+    // size.
+    static constexpr size_t k_vertex_batch_size = 1024;
+
+    // Triangles are clipped, set up and binned in at most this many batches
+    // of at least k_vertex_batch_size triangles, in parallel.
+    static constexpr size_t k_max_triangle_batch_count = 64;
+
+    // The screen is split into k_tile_size x k_tile_size tiles. Triangles are
+    // binned into every tile their bounding box touches, then each tile is
+    // rasterized by a single worker, so no two threads write the same pixel.
+    static constexpr int k_tile_size = k_layout_tile_size;
+
+    // Blocks are the unit of the early-out coverage tests inside a tile.
+    static constexpr int k_block_size = k_layout_block_size;
+
+    // Screen positions are snapped to 28.4 fixed point before rasterizing.
+    static constexpr int k_subpixel_bits  = 4;
+    static constexpr int k_subpixel_scale = 1 << k_subpixel_bits;
+
+    // Triangles are clipped against the near plane, and against x / y only
+    // when they reach more than k_guard_band pixels outside of the viewport.
+    // The rest of the off-screen parts are skipped by the bounding box and
+    // the edge tests.
+    static constexpr int   k_max_viewport_size = 16384;
+    static constexpr float k_guard_band        = 4096.0f;
+
+    // Triangles reaching outside of this range (in pixels) are rejected, it
+    // holds the viewport and its guard band with some room for the rounding
+    // of clipping. The edge values inside a block fit in 32 bits over it.
+    static constexpr float k_max_screen_coord =
+        k_max_viewport_size + k_guard_band + 1.0f;
+    static_assert(4.0 * k_max_screen_coord * k_subpixel_scale * k_block_size *
+                          k_subpixel_scale <
+                      2147483648.0,
+                  "the edge values of a block overflow 32 bits");
+
+    static constexpr int k_clip_plane_count = 5;
+    static constexpr int k_max_clip_vertex  = 3 + k_clip_plane_count;
+
+    // The standard sample positions inside a pixel, in 1 / k_subpixel_scale
+    // pixel.
+    using SamplePosition = int[2];
+
+    static constexpr int            k_max_sample_count   = 16;
+    static constexpr SamplePosition k_sample_pattern_1[] = {
+        {8, 8},
+    };
+    static constexpr SamplePosition k_sample_pattern_2[] = {
+        {12, 12},
+        { 4,  4},
+    };
+    static constexpr SamplePosition k_sample_pattern_4[] = {
+        { 6,  2},
+        {14,  6},
+        { 2, 10},
+        {10, 14},
+    };
+    static constexpr SamplePosition k_sample_pattern_8[] = {
+        { 9,  5},
+        { 7, 11},
+        {13,  9},
+        { 5,  3},
+        { 3, 13},
+        { 1,  7},
+        {11, 15},
+        {15,  1},
+    };
+    static constexpr SamplePosition k_sample_pattern_16[] = {
+        { 9,  9},
+        { 7,  5},
+        { 5, 10},
+        {12,  7},
+        { 3,  6},
+        {10, 13},
+        {13, 11},
+        {11,  3},
+        { 6, 14},
+        { 8,  1},
+        { 4,  2},
+        { 2, 12},
+        { 0,  8},
+        {15,  4},
+        {14, 15},
+        { 1,  0},
     };
 
+    static constexpr const SamplePosition* getSamplePattern(int sample_count)
+    {
+        switch (sample_count)
+        {
+            case 2: return k_sample_pattern_2;
+            case 4: return k_sample_pattern_4;
+            case 8: return k_sample_pattern_8;
+            case 16: return k_sample_pattern_16;
+            default: return k_sample_pattern_1;
+        }
+    }
+    static constexpr bool isValidSampleCount(int sample_count)
+    {
+        return sample_count == 1 || sample_count == 2 || sample_count == 4 ||
+               sample_count == 8 || sample_count == 16;
+    }
+
 public:
     Rasterizer()                             = default;
     Rasterizer(const Rasterizer&)            = delete;
@@ -54,63 +175,448 @@ public:
     bool init(const Desc& desc);
     void exit();
 
+    // Fast clears: only the tiles are flagged, a tile's buffers are filled
+    // when it is first drawn to, or in resolve() for the color.
     void clearFrameBuffer()
     {
-        std::fill(m_frame_buffer.begin(),
-                  m_frame_buffer.end(),
-                  glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
-        std::fill(m_render_result.begin(),
-                  m_render_result.end(),
-                  glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
+        for (auto& state : m_tile_color_states)
+        {
+            if (state == TileColorState::Written)
+            {
+                state = TileColorState::Cleared;
+            }
+        }
+        for (auto& pool : m_tile_samples)
+        {
+            pool.pixels.clear();
+            pool.colors.clear();
+        }
+        m_draw_count = 0;
     }
     void clearDepthBuffer()
     {
-        std::fill(
-            m_depth_buffer.begin(), m_depth_buffer.end(), k_max_relative_depth);
+        std::fill(m_tile_depth_cleared.begin(), m_tile_depth_cleared.end(), 1);
     }
 
     void setCullMode(CullMode mode) { m_cull_mode = mode; }
-    void setEnable4xMsaa(bool val) { m_enable_4x_msaa = val; }
+    // Takes effect from the next cleared frame.
+    void setSampleCount(int sample_count);
+    int  getSampleCount() const { return m_sample_count; }
 
-    const std::vector<glm::vec4>& getFramebuffer() const
+    // The view stays valid until the sample count grows.
+    DepthBufferView getDepthView() const
     {
-        return m_frame_buffer;
+        DepthBufferView view;
+        view.data         = m_depth_buffer.data();
+        view.format       = m_depth_format;
+        view.width        = m_width;
+        view.height       = m_height;
+        view.sample_count = m_sample_count;
+        view.tiled        = m_tiled_layout;
+        view.tile_cleared = m_tile_depth_cleared.data();
+        view.clear_depth  = k_max_relative_depth;
+        return view;
     }
-    const std::vector<float>& getDepthBuffer() const { return m_depth_buffer; }
 
-    const std::vector<glm::vec4>& getRenderResult() const
+    // The resolved colors, packed in getColorFormat(), in rows.
+    const std::vector<uint8_t>& getColorBuffer() const
     {
-        return m_render_result;
+        return m_tiled_layout ? m_linear_color_buffer : m_color_buffer;
     }
+    ColorFormat getColorFormat() const { return m_color_format; }
 
     int getWidth() const { return m_width; }
     int getHeight() const { return m_height; }
 
-    void render(const std::vector<Vertex>& vertices,
-                const std::vector<size_t>& indices,
-                const VertexShader&        vert_shader,
-                const FragmentShader&      frag_shader);
+    // The raster loop is instantiated for the shader types, so that the
+    // shaders are inlined into it. It is picked over the virtual path below
+    // when the shaders are passed with their own types, and only the final
+    // shader types are called directly, the others stay virtual.
+    // The vertex shader only fetches the attributes it declares.
+    template <typename VS, typename FS>
+    void render(const VertexBuffer& vertices,
+                const IndexBuffer&  indices,
+                const VS&           vert_shader,
+                const FS&           frag_shader);
+    // Shaders called through their virtual operator().
+    void render(const VertexBuffer&   vertices,
+                const IndexBuffer&    indices,
+                const VertexShader&   vert_shader,
+                const FragmentShader& frag_shader)
+    {
+        render<VertexShader, FragmentShader>(
+            vertices, indices, vert_shader, frag_shader);
+    }
+    // Depth only draws, of the shadow maps for example. Only the positions
+    // are transformed, nothing is interpolated or shaded and the color
+    // buffer is not written.
+    void renderDepth(const VertexBuffer&   vertices,
+                     const IndexBuffer&    indices,
+                     const DepthTransform& transform);
+
+    // Finish the frame: shade the pixels in visibility buffer mode, resolve
+    // the msaa samples and fill the cleared tiles. Call it after the last
+    // render() of the frame.
+    void resolve();
 
     void saveImage() const;
 
 private:
-    size_t getIdx(int x, int y) const { return (y * m_width) + x; }
+    // E(x, y) = a * x + b * y + c, with x and y in 28.4 fixed point. The
+    // value is positive on the inner side of the edge. A sample exactly on
+    // the edge is only covered by top-left edges, which have a bias of 0.
+    struct EdgeFunction
+    {
+        int32_t a;
+        int32_t b;
+        int64_t c;
+        int32_t bias;
+
+        int64_t evaluate(int64_t x, int64_t y) const
+        {
+            return a * x + b * y + c;
+        }
+    };
+
+    // Everything the rasterizer needs from a triangle, computed once after
+    // culling. Vertices are ordered counter clockwise on the screen and
+    // edge[i] is the edge opposite to v[i]. The vertices are not kept by the
+    // depth only draws.
+    struct TriangleSetup
+    {
+        const VertexShader::Output* v[3];
+
+        EdgeFunction edge[3];
+        float        inv_area;  // 1 / (2 * area) in 28.4 units.
+        float        inv_z[3];
+        float        inv_z_dx;  // Gradient of 1 / depth per 28.4 unit.
+        float        inv_z_dy;
+        float        z_min;  // Depth range of the triangle, as the values
+        float        z_max;  // stored in the depth buffer.
+
+        int x_lo;
+        int x_hi;
+        int y_lo;
+        int y_hi;
+    };
+
+    // The sample loops are specialized on the sample count, the depth format
+    // and the fragment shader type.
+    using RasterizeTriangleFunc = bool (Rasterizer::*)(const TriangleSetup&,
+                                                       int,
+                                                       int,
+                                                       int,
+                                                       int,
+                                                       const FragmentShader&,
+                                                       uint64_t);
+    using ShadePixelFunc        = glm::vec4 (Rasterizer::*)(
+        const TriangleSetup&, int, int, uint32_t, const FragmentShader&)
+        const;
+
+    // The fragment shader of the depth only draws, which is never called.
+    struct FSDepthOnly final : public FragmentShader
+    {
+        static constexpr VaryingSet<FSDepthOnly> k_varyings{ 0 };
+
+        glm::vec4 operator()(const Input&) const override
+        {
+            return glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+        }
+    };
+
+    // The data of one render() call. In visibility buffer mode it is kept
+    // until resolve(), because the shading needs it. The slots are reused
+    // by the draws of the following frames, and their buffers only grow, so
+    // the geometry stage stops allocating once the scene has been drawn.
+    struct DrawCall
+    {
+        std::vector<VertexShader::Output> vertices;
+        std::vector<TriangleSetup>        triangles;
+        const FragmentShader*             frag_shader = nullptr;
+        uint32_t                          varyings    = 0;
+
+        // Specialized on the type of frag_shader. The depth only draws have
+        // no shade_pixel, they write no visibility id.
+        RasterizeTriangleFunc rasterize   = nullptr;
+        ShadePixelFunc        shade_pixel = nullptr;
+    };
+
+    // The triangles of a batch, and its own tile bins. A tile walks the bins
+    // of the batches in order, which keeps the submission order without
+    // merging them. The vertices added by clipping are kept in the batch,
+    // their indices flagged with k_clipped_vertex, until they are appended
+    // to the vertex list.
+    struct TriangleBatch
+    {
+        std::vector<uint32_t>               indices;
+        std::vector<VertexShader::Output>   clipped_vertices;
+        std::vector<DepthTransform::Output> clipped_depth_vertices;
+        size_t                              first_vertex   = 0;
+        size_t                              first_triangle = 0;
+
+        std::vector<std::vector<uint32_t>> tile_bins;
+        std::vector<uint32_t>              active_tiles;
 
-    void processTriangle(const VertexShader::Output& v0,
-                         const VertexShader::Output& v1,
-                         const VertexShader::Output& v2,
-                         const FragmentShader&       frag_shader);
+        template <typename Output>
+        std::vector<Output>& getClippedVertices()
+        {
+            if constexpr (std::is_same_v<Output, DepthTransform::Output>)
+            {
+                return clipped_depth_vertices;
+            }
+            else
+            {
+                return clipped_vertices;
+            }
+        }
+    };
+
+    static constexpr uint32_t k_clipped_vertex = 1u << 31;
+
+    // The msaa pixels of a tile which are not fully covered by one color.
+    // Slot i is pixel pixels[i], with its samples at colors[i * samples].
+    struct TileSamples
+    {
+        std::vector<uint32_t>  pixels;
+        std::vector<glm::vec4> colors;
+    };
+
+    // The color buffer of a Cleared tile is stale, a ClearFilled tile holds
+    // the clear color but its other buffers may be stale.
+    enum class TileColorState : uint8_t
+    {
+        Written = 0,
+        Cleared,
+        ClearFilled
+    };
+
+    // m_sample_slots holds (slot << 1) | k_sample_slot_used for the pixels
+    // which have a slot in their tile's sample pool.
+    static constexpr uint32_t k_no_sample_slot   = ~0u;
+    static constexpr uint32_t k_sample_slot_used = 1u;
+
+    // Draw id in the high 32 bits and triangle id in the low 32 bits.
+    static constexpr uint64_t k_invalid_visibility_id = ~uint64_t(0);
+
+    size_t getTileCount() const
+    {
+        return size_t(m_tile_count_x) * m_tile_count_y;
+    }
+    size_t getIdx(int x, int y) const
+    {
+        return m_tiled_layout ? getTiledIdx(x, y, m_tile_count_x)
+                              : (y * m_width) + x;
+    }
+    size_t getPixelCount() const
+    {
+        return m_tiled_layout ? getTiledBufferSize(m_width, m_height)
+                              : size_t(m_width) * m_height;
+    }
+    size_t getBlockIdx(int x, int y) const
+    {
+        return (y / k_block_size) * m_block_count_x + (x / k_block_size);
+    }
+
+    // Calls func(first pixel index, pixel count) for the contiguous spans
+    // of pixels covering the tile: the whole tile in the tiled layout, or
+    // its rows.
+    template <typename Func>
+    void forEachTileSpan(size_t tile_idx, Func func) const
+    {
+        const int tile_x_lo = int(tile_idx % m_tile_count_x) * k_tile_size;
+        const int tile_y_lo = int(tile_idx / m_tile_count_x) * k_tile_size;
+        if (m_tiled_layout)
+        {
+            func(getIdx(tile_x_lo, tile_y_lo),
+                 size_t(k_tile_size) * k_tile_size);
+            return;
+        }
+
+        const int tile_x_hi = getMin(tile_x_lo + k_tile_size, m_width) - 1;
+        const int tile_y_hi = getMin(tile_y_lo + k_tile_size, m_height) - 1;
+        for (int y = tile_y_lo; y <= tile_y_hi; ++y)
+        {
+            func(getIdx(tile_x_lo, y), size_t(tile_x_hi - tile_x_lo + 1));
+        }
+    }
+
+    // The geometry stages work on VertexShader::Output, or on the
+    // DepthTransform::Output of the depth only draws.
+    // Appends the vertex indices of the clipped triangles and the new
+    // vertices to the batch.
+    template <typename Output>
+    void clipTriangle(const std::vector<Output>& vertices,
+                      uint32_t                   varyings,
+                      uint32_t                   i0,
+                      uint32_t                   i1,
+                      uint32_t                   i2,
+                      TriangleBatch&             batch) const;
+    template <typename Output>
+    bool setupTriangle(const Output&  v0,
+                       const Output&  v1,
+                       const Output&  v2,
+                       TriangleSetup& setup) const;
+    // Clips, projects and sets up the triangles into draw.triangles, and
+    // bins them. The culled triangles stay in draw.triangles, unbinned.
+    template <typename Output>
+    void setupTriangles(const IndexBuffer&   indices,
+                        std::vector<Output>& vertices,
+                        DrawCall&            draw);
+
+    // The stages of render() which do not depend on the shader types.
+    uint32_t beginDraw(const FragmentShader& frag_shader,
+                       uint32_t              varyings,
+                       RasterizeTriangleFunc rasterize,
+                       ShadePixelFunc        shade_pixel);
+    void     assembleTriangles(const IndexBuffer& indices, DrawCall& draw);
+    void     rasterizeDraw(const DrawCall& draw, uint32_t draw_id);
+
+    void binTriangle(const TriangleSetup& triangle,
+                     uint32_t             triangle_idx,
+                     TriangleBatch&       batch) const;
+    // Fill the flagged buffers of a tile with the clear values before it is
+    // drawn to.
+    void prepareTile(size_t tile_idx);
+    void fillTileColor(size_t tile_idx);
+    void rasterizeTile(size_t          tile_idx,
+                       const DrawCall& draw,
+                       uint32_t        draw_id);
+
+    template <typename FS>
+    RasterizeTriangleFunc getRasterizeTriangleFunc() const;
+    template <typename FS, DepthFormat Format>
+    RasterizeTriangleFunc getRasterizeTriangleFunc() const;
+
+    template <int SampleCount, DepthFormat Format, typename FS>
+    bool rasterizeTriangle(const TriangleSetup&  setup,
+                           int                   x_lo,
+                           int                   x_hi,
+                           int                   y_lo,
+                           int                   y_hi,
+                           const FragmentShader& frag_shader,
+                           uint64_t              visibility_id);
+    template <int SampleCount, DepthFormat Format, typename FS>
+    bool rasterizeBlock(const TriangleSetup&  setup,
+                        const RasterLanes*    lanes,
+                        uint32_t              edge_mask,
+                        bool                  test_depth,
+                        int                   x_lo,
+                        int                   x_hi,
+                        int                   y_lo,
+                        int                   y_hi,
+                        const FragmentShader& frag_shader,
+                        uint64_t              visibility_id);
+
+    // Write the visibility ids, or shade and write the colors, of the passed
+    // samples of the run of pixels from (x, y).
+    template <int SampleCount, typename FS>
+    void writeRun(const TriangleSetup&  setup,
+                  int                   x,
+                  int                   y,
+                  uint32_t              covered,
+                  uint32_t              passed,
+                  const FragmentShader& frag_shader,
+                  uint64_t              visibility_id);
+
+    // Shade the fragment of pixel (x, y) for the covered samples. It is
+    // shaded at the pixel center if the triangle covers it, or else at the
+    // first covered sample.
+    template <typename FS>
+    glm::vec4 shadePixel(const TriangleSetup&  setup,
+                         int                   x,
+                         int                   y,
+                         uint32_t              covered,
+                         const FragmentShader& frag_shader) const;
+    // Perspective-correct texcoords at the center of pixel (x, y), which may
+    // be outside of the triangle.
+    glm::vec2 getTexcoords(const TriangleSetup& setup, int x, int y) const;
+    void writeColor(int x, int y, uint32_t samples, const glm::vec4& color);
+    void storeColor(size_t pixel_idx, const glm::vec4& color)
+    {
+        packColor(m_color_format,
+                  m_srgb,
+                  color,
+                  &m_color_buffer[pixel_idx * m_color_size]);
+    }
+    glm::vec4 loadColor(size_t pixel_idx) const
+    {
+        return unpackColor(
+            m_color_format, m_srgb, &m_color_buffer[pixel_idx * m_color_size]);
+    }
+
+    void shadeVisibilityTile(size_t tile_idx);
+    void linearizeTile(size_t tile_idx);
+    void resolveMsaa(size_t tile_idx);
+
+    // Farthest depth of the blocks overlapping the rectangle, from the
+    // hierarchical z.
+    float getMaxDepth(int x_lo, int x_hi, int y_lo, int y_hi) const;
+    // Farthest depth of the block at (bx, by), from the depth buffer.
+    float computeBlockMaxDepth(int bx, int by) const;
+    template <DepthFormat Format>
+    float computeBlockMaxDepth(int bx, int by) const;
 
 private:
-    int  m_width          = 1280;
-    int  m_height         = 720;
-    bool m_draw_color     = true;
-    bool m_draw_depth     = true;
-    bool m_enable_4x_msaa = false;
+    int  m_width             = 1280;
+    int  m_height            = 720;
+    bool m_draw_color        = true;
+    bool m_draw_depth        = true;
+    int  m_sample_count      = 1;
+    bool m_enable_visibility = false;
+    bool m_tiled_layout      = false;
 
     CullMode m_cull_mode = CullMode::None;
 
-    std::vector<glm::vec4> m_frame_buffer;
-    std::vector<float>     m_depth_buffer;
-    std::vector<glm::vec4> m_render_result;
-};
\ No newline at end of file
+    // Clip space planes, a position p is inside when dot(plane, p) >= 0.
+    glm::vec4 m_clip_planes[k_clip_plane_count];
+    glm::vec4 m_frustum_planes[k_clip_plane_count];
+
+    ColorFormat          m_color_format = ColorFormat::RGBA32F;
+    bool                 m_srgb         = false;
+    size_t               m_color_size   = 16;
+    std::vector<uint8_t> m_color_buffer;
+    std::vector<uint8_t> m_linear_color_buffer;  // For the tiled layout.
+    uint8_t              m_clear_color[k_max_color_size];
+    DepthFormat          m_depth_format = DepthFormat::D32F;
+    size_t               m_depth_size   = 4;
+    std::vector<uint8_t> m_depth_buffer;
+
+    // Fast clear state of every tile.
+    std::vector<TileColorState> m_tile_color_states;
+    std::vector<uint8_t>        m_tile_depth_cleared;
+
+    // Compressed msaa color: m_color_buffer holds the color of the fully
+    // covered pixels, only the other pixels store their samples, in linear
+    // float, in the sample pool of their tile. A tile's pool is only written
+    // by the tile's worker.
+    std::vector<uint32_t>    m_sample_slots;
+    std::vector<TileSamples> m_tile_samples;
+
+    // Hierarchical z: the depth range of every k_block_size^2 block, as the
+    // values stored in the depth buffer. The range is conservative, the real
+    // depth values are always inside it.
+    int                m_block_count_x = 0;
+    int                m_block_count_y = 0;
+    std::vector<float> m_hiz_min;
+    std::vector<float> m_hiz_max;
+
+    // Visibility ids of the samples, in visibility buffer mode.
+    std::vector<uint64_t> m_visibility_buffer;
+
+    // Draw data, reused between draws to avoid reallocation.
+    std::vector<DrawCall> m_draws;
+    uint32_t              m_draw_count = 0;
+
+    // The vertices of the depth only draws, which are not kept in the draws.
+    std::vector<DepthTransform::Output> m_depth_vertices;
+
+    // Binning data, reused between draws to avoid reallocation.
+    int                        m_tile_count_x = 0;
+    int                        m_tile_count_y = 0;
+    std::vector<TriangleBatch> m_triangle_batches;
+    size_t                     m_triangle_batch_count = 0;
+    std::vector<uint32_t>      m_active_tiles;
+    std::vector<uint8_t>       m_tile_active;
+};
+
+#include "RasterizerImpl.hpp"
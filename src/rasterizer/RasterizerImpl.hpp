@@ -0,0 +1,523 @@
+#pragma once
+#include <type_traits>
+
+#include <tbb/tbb.h>
+
+// The templated parts of Rasterizer, included at the end of Rasterizer.h.
+// They are instantiated for the shader types of every render<VS, FS>().
+
+// Call the operator() of the Shader type directly, so that it is inlined into
+// the caller. Only a final type is sure to be the type of the object, the
+// others go through the virtual call.
+template <typename Shader, typename Input>
+static auto invokeShader(const Shader& shader, const Input& input)
+{
+    if constexpr (std::is_final_v<Shader>)
+    {
+        return shader.Shader::operator()(input);
+    }
+    else
+    {
+        return shader(input);
+    }
+}
+
+// The varyings interpolated for the fragment shader type FS. A shader passed
+// as a type which is not final may be of a derived type reading more of them.
+template <typename FS>
+static constexpr uint32_t getVaryings()
+{
+    static_assert(
+        std::is_same_v<decltype(FS::k_varyings), const VaryingSet<FS>>,
+        "the fragment shader type must declare its own k_varyings");
+
+    return std::is_final_v<FS> ? FS::k_varyings.mask
+                               : FragmentShader::k_varying_all;
+}
+
+// The vertex attributes fetched for the vertex shader type VS. A shader
+// passed as a type which is not final may be of a derived type reading more
+// of them.
+template <typename VS>
+static constexpr uint32_t getAttributes()
+{
+    static_assert(
+        std::is_same_v<decltype(VS::k_attributes), const AttributeSet<VS>>,
+        "the vertex shader type must declare its own k_attributes");
+
+    return std::is_final_v<VS> ? VS::k_attributes.mask
+                               : Vertex::k_attribute_all;
+}
+
+// Perspective-correct interpolation of the vertex shader outputs which the
+// fragment shader declares in Varyings.
+template <uint32_t Varyings>
+static FragmentShader::Input interpolateInput(const VertexShader::Output& v0,
+                                              const VertexShader::Output& v1,
+                                              const VertexShader::Output& v2,
+                                              float                       z0_,
+                                              float                       z1_,
+                                              float                       z2_,
+                                              float                       zt)
+{
+    FragmentShader::Input input{};
+    if constexpr (Varyings & FragmentShader::k_varying_mv_position)
+    {
+        input.mv_position = interpolate(
+            v0.mv_position, v1.mv_position, v2.mv_position, z0_, z1_, z2_, zt);
+    }
+    if constexpr (Varyings & FragmentShader::k_varying_mv_normal)
+    {
+        input.mv_normal = glm::normalize(interpolate(
+            v0.mv_normal, v1.mv_normal, v2.mv_normal, z0_, z1_, z2_, zt));
+    }
+    if constexpr (Varyings & FragmentShader::k_varying_light_space_pos)
+    {
+        input.light_space_pos = interpolate(v0.light_space_pos,
+                                            v1.light_space_pos,
+                                            v2.light_space_pos,
+                                            z0_,
+                                            z1_,
+                                            z2_,
+                                            zt);
+    }
+    if constexpr (Varyings & FragmentShader::k_varying_color)
+    {
+        input.color =
+            interpolate(v0.color, v1.color, v2.color, z0_, z1_, z2_, zt);
+    }
+    if constexpr (Varyings & FragmentShader::k_varying_texcoords)
+    {
+        input.texcoords = interpolate(
+            v0.texcoords, v1.texcoords, v2.texcoords, z0_, z1_, z2_, zt);
+    }
+
+    if constexpr (Varyings &
+                  FragmentShader::k_varying_tangent_space_light_pos)
+    {
+        input.tangent_space_light_pos =
+            interpolate(v0.tangent_space_light_pos,
+                        v1.tangent_space_light_pos,
+                        v2.tangent_space_light_pos,
+                        z0_,
+                        z1_,
+                        z2_,
+                        zt);
+    }
+    if constexpr (Varyings & FragmentShader::k_varying_tangent_space_view_pos)
+    {
+        input.tangent_space_view_pos =
+            interpolate(v0.tangent_space_view_pos,
+                        v1.tangent_space_view_pos,
+                        v2.tangent_space_view_pos,
+                        z0_,
+                        z1_,
+                        z2_,
+                        zt);
+    }
+    if constexpr (Varyings & FragmentShader::k_varying_tangent_space_frag_pos)
+    {
+        input.tangent_space_frag_pos =
+            interpolate(v0.tangent_space_frag_pos,
+                        v1.tangent_space_frag_pos,
+                        v2.tangent_space_frag_pos,
+                        z0_,
+                        z1_,
+                        z2_,
+                        zt);
+    }
+
+    return input;
+}
+
+template <typename VS, typename FS>
+void Rasterizer::render(const VertexBuffer& vertices,
+                        const IndexBuffer&  indices,
+                        const VS&           vert_shader,
+                        const FS&           frag_shader)
+{
+    const uint32_t draw_id = beginDraw(frag_shader,
+                                       getVaryings<FS>(),
+                                       getRasterizeTriangleFunc<FS>(),
+                                       &Rasterizer::shadePixel<FS>);
+    DrawCall&      draw    = m_draws[draw_id];
+
+
+    // Run vertex shader on each vertex.
+    std::vector<VertexShader::Output>& vertex_after_vs = draw.vertices;
+    vertex_after_vs.resize(vertices.size());
+    tbb::parallel_for(
+        tbb::blocked_range<size_t>(0, vertices.size(), k_vertex_batch_size),
+        [&vertex_after_vs, &vertices, &vert_shader](
+            tbb::blocked_range<size_t> r)
+        {
+            for (size_t i = r.begin(); i != r.end(); ++i)
+            {
+                vertex_after_vs[i] = invokeShader(
+                    vert_shader, vertices.getVertex<getAttributes<VS>()>(i));
+            }
+        });
+
+    assembleTriangles(indices, draw);
+    rasterizeDraw(draw, draw_id);
+}
+
+template <typename FS>
+Rasterizer::RasterizeTriangleFunc Rasterizer::getRasterizeTriangleFunc() const
+{
+    switch (m_depth_format)
+    {
+        case DepthFormat::D24:
+            return getRasterizeTriangleFunc<FS, DepthFormat::D24>();
+        case DepthFormat::D16:
+            return getRasterizeTriangleFunc<FS, DepthFormat::D16>();
+        default: return getRasterizeTriangleFunc<FS, DepthFormat::D32F>();
+    }
+}
+
+template <typename FS, DepthFormat Format>
+Rasterizer::RasterizeTriangleFunc Rasterizer::getRasterizeTriangleFunc() const
+{
+    switch (m_sample_count)
+    {
+        case 2: return &Rasterizer::rasterizeTriangle<2, Format, FS>;
+        case 4: return &Rasterizer::rasterizeTriangle<4, Format, FS>;
+        case 8: return &Rasterizer::rasterizeTriangle<8, Format, FS>;
+        case 16: return &Rasterizer::rasterizeTriangle<16, Format, FS>;
+        default: return &Rasterizer::rasterizeTriangle<1, Format, FS>;
+    }
+}
+
+template <int SampleCount, DepthFormat Format, typename FS>
+bool Rasterizer::rasterizeTriangle(const TriangleSetup&  setup,
+                                   int                   x_lo,
+                                   int                   x_hi,
+                                   int                   y_lo,
+                                   int                   y_hi,
+                                   const FragmentShader& frag_shader,
+                                   uint64_t              visibility_id)
+{
+    // With more samples than lanes, a pixel takes several groups.
+    constexpr int k_group_count = (SampleCount > k_raster_lane_count)
+                                      ? SampleCount / k_raster_lane_count
+                                      : 1;
+
+    const SamplePosition* sample_pos = getSamplePattern(SampleCount);
+
+    // Lane l of group g is sample (i % SampleCount) of the pixel
+    // (i / SampleCount) of the run, with i = g * k_raster_lane_count + l.
+    RasterLanes lanes[k_group_count];
+    for (int g = 0; g < k_group_count; ++g)
+    {
+        for (int e = 0; e < 3; ++e)
+        {
+            lanes[g].edge_threshold[e] = setup.edge[e].bias - 1;
+        }
+        for (int l = 0; l < k_raster_lane_count; ++l)
+        {
+            const int  i   = g * k_raster_lane_count + l;
+            const int* pos = sample_pos[i % SampleCount];
+            const int  dx  = (i / SampleCount) * k_subpixel_scale + pos[0];
+            const int  dy  = pos[1];
+            for (int e = 0; e < 3; ++e)
+            {
+                lanes[g].edge[e][l] =
+                    setup.edge[e].a * dx + setup.edge[e].b * dy;
+            }
+            lanes[g].inv_z[l] =
+                setup.inv_z_dx * float(dx) + setup.inv_z_dy * float(dy);
+        }
+    }
+
+
+    // Walk the blocks overlapping the rectangle. Blocks behind the hierarchical
+    // z or outside of any edge are skipped, and edges which contain the whole
+    // block are not tested.
+    constexpr int k_block_extent = k_block_size * k_subpixel_scale - 1;
+
+    bool is_hiz_changed = false;
+
+    const int bx_lo = x_lo & ~(k_block_size - 1);
+    const int by_lo = y_lo & ~(k_block_size - 1);
+    for (int by = by_lo; by <= y_hi; by += k_block_size)
+    {
+        for (int bx = bx_lo; bx <= x_hi; bx += k_block_size)
+        {
+            const size_t block_idx = getBlockIdx(bx, by);
+            if (setup.z_min >= m_hiz_max[block_idx])
+            {
+                continue;
+            }
+
+            const int64_t block_x = int64_t(bx) << k_subpixel_bits;
+            const int64_t block_y = int64_t(by) << k_subpixel_bits;
+
+            bool     is_outside = false;
+            uint32_t edge_mask  = 0;
+            for (int e = 0; e < 3 && !is_outside; ++e)
+            {
+                const EdgeFunction& edge = setup.edge[e];
+
+                // The block corners where the edge function is the largest
+                // and the smallest.
+                int64_t hi_x = block_x + (edge.a > 0 ? k_block_extent : 0);
+                int64_t hi_y = block_y + (edge.b > 0 ? k_block_extent : 0);
+                int64_t lo_x = block_x + (edge.a > 0 ? 0 : k_block_extent);
+                int64_t lo_y = block_y + (edge.b > 0 ? 0 : k_block_extent);
+
+                is_outside = (edge.evaluate(hi_x, hi_y) < edge.bias);
+                if (edge.evaluate(lo_x, lo_y) < edge.bias)
+                {
+                    edge_mask |= (1u << e);
+                }
+            }
+            if (is_outside)
+            {
+                continue;
+            }
+
+            // A block inside the triangle and in front of everything drawn
+            // there passes the depth test everywhere.
+            const bool is_in_front =
+                (edge_mask == 0 && setup.z_max < m_hiz_min[block_idx]);
+
+            const int px_lo = getMax(bx, x_lo);
+            const int px_hi = getMin(bx + k_block_size - 1, x_hi);
+            const int py_lo = getMax(by, y_lo);
+            const int py_hi = getMin(by + k_block_size - 1, y_hi);
+
+            bool is_written =
+                rasterizeBlock<SampleCount, Format, FS>(setup,
+                                                        lanes,
+                                                        edge_mask,
+                                                        !is_in_front,
+                                                        px_lo,
+                                                        px_hi,
+                                                        py_lo,
+                                                        py_hi,
+                                                        frag_shader,
+                                                        visibility_id);
+
+            if (is_written && m_draw_depth)
+            {
+                m_hiz_min[block_idx] =
+                    getMin(m_hiz_min[block_idx], setup.z_min);
+                m_hiz_max[block_idx] =
+                    is_in_front ? setup.z_max : computeBlockMaxDepth(bx, by);
+                is_hiz_changed = true;
+            }
+        }
+    }
+
+    return is_hiz_changed;
+}
+
+template <int SampleCount, DepthFormat Format, typename FS>
+bool Rasterizer::rasterizeBlock(const TriangleSetup&  setup,
+                                const RasterLanes*    lanes,
+                                uint32_t              edge_mask,
+                                bool                  test_depth,
+                                int                   x_lo,
+                                int                   x_hi,
+                                int                   y_lo,
+                                int                   y_hi,
+                                const FragmentShader& frag_shader,
+                                uint64_t              visibility_id)
+{
+    // A run of pixels in a row with all their samples is tested at once,
+    // in one or more groups of lanes.
+    constexpr int      k_group_count  = (SampleCount > k_raster_lane_count)
+                                            ? SampleCount / k_raster_lane_count
+                                            : 1;
+    constexpr int      k_group_pixels = (SampleCount < k_raster_lane_count)
+                                            ? k_raster_lane_count / SampleCount
+                                            : 1;
+    constexpr uint32_t k_full_mask    = (1u << SampleCount) - 1;
+    constexpr uint32_t k_group_mask   = (1u << k_raster_lane_count) - 1;
+
+    using Type = typename DepthTraits<Format>::Type;
+
+    bool is_written = false;
+
+    const int bx = x_lo & ~(k_block_size - 1);
+    for (int y = y_lo; y <= y_hi; ++y)
+    {
+        for (int gx = bx; gx <= x_hi; gx += k_group_pixels)
+        {
+            uint32_t lane_mask = 0;
+            for (int p = 0; p < k_group_pixels; ++p)
+            {
+                if (gx + p >= x_lo && gx + p <= x_hi)
+                {
+                    lane_mask |= (k_full_mask << (p * SampleCount));
+                }
+            }
+            if (lane_mask == 0)
+            {
+                continue;
+            }
+
+            // The values of a tested edge are bounded by the block size, so
+            // they fit in 32 bits.
+            RasterGroup group;
+            int64_t     e_group[3];
+            for (int e = 0; e < 3; ++e)
+            {
+                e_group[e] =
+                    setup.edge[e].evaluate(int64_t(gx) << k_subpixel_bits,
+                                           int64_t(y) << k_subpixel_bits);
+                group.edge[e] =
+                    (edge_mask & (1u << e)) ? int32_t(e_group[e]) : 0;
+            }
+
+            float beta  = float(e_group[1]) * setup.inv_area;
+            float gamma = float(e_group[2]) * setup.inv_area;
+
+            group.edge_mask = edge_mask;
+            group.inv_z     = (1.0f - beta - gamma) * setup.inv_z[0] +
+                          beta * setup.inv_z[1] + gamma * setup.inv_z[2];
+            group.test_depth  = test_depth;
+            group.write_depth = m_draw_depth;
+
+            Type* depth = reinterpret_cast<Type*>(m_depth_buffer.data()) +
+                          getIdx(gx, y) * SampleCount;
+            uint32_t covered = 0;
+            uint32_t passed  = 0;
+            for (int g = 0; g < k_group_count; ++g)
+            {
+                const int shift = g * k_raster_lane_count;
+                group.lane_mask = (lane_mask >> shift) & k_group_mask;
+                group.depth     = depth + shift;
+
+                uint32_t group_covered = 0;
+                passed |= testCoverageAndDepth<Format>(
+                               lanes[g], group, group_covered)
+                          << shift;
+                covered |= group_covered << shift;
+            }
+            is_written |= (passed != 0);
+
+            // The depth only draws stop at the depth test, their color path
+            // is not even instantiated.
+            if constexpr (!std::is_same_v<FS, FSDepthOnly>)
+            {
+                if (passed != 0 && m_draw_color)
+                {
+                    writeRun<SampleCount, FS>(setup,
+                                              gx,
+                                              y,
+                                              covered,
+                                              passed,
+                                              frag_shader,
+                                              visibility_id);
+                }
+            }
+        }
+    }
+
+    return is_written;
+}
+
+template <int SampleCount, typename FS>
+void Rasterizer::writeRun(const TriangleSetup&  setup,
+                          int                   x,
+                          int                   y,
+                          uint32_t              covered,
+                          uint32_t              passed,
+                          const FragmentShader& frag_shader,
+                          uint64_t              visibility_id)
+{
+    constexpr int      k_run_pixels = (SampleCount < k_raster_lane_count)
+                                          ? k_raster_lane_count / SampleCount
+                                          : 1;
+    constexpr int      k_run_lanes  = k_run_pixels * SampleCount;
+    constexpr uint32_t k_full_mask  = (1u << SampleCount) - 1;
+
+    // Only remember which triangle is visible, it is shaded later.
+    if (m_enable_visibility)
+    {
+        uint64_t* ids = &m_visibility_buffer[getIdx(x, y) * SampleCount];
+        for (int l = 0; l < k_run_lanes; ++l)
+        {
+            if (passed & (1u << l))
+            {
+                ids[l] = visibility_id;
+            }
+        }
+        return;
+    }
+
+    for (int p = 0; p < k_run_pixels; ++p)
+    {
+        const uint32_t pixel_passed =
+            (passed >> (p * SampleCount)) & k_full_mask;
+        if (pixel_passed == 0)
+        {
+            continue;
+        }
+
+        glm::vec4 color = shadePixel<FS>(setup,
+                                         x + p,
+                                         y,
+                                         (covered >> (p * SampleCount)) &
+                                             k_full_mask,
+                                         frag_shader);
+        writeColor(x + p, y, pixel_passed, color);
+    }
+}
+
+template <typename FS>
+glm::vec4 Rasterizer::shadePixel(const TriangleSetup&  setup,
+                                 int                   x,
+                                 int                   y,
+                                 uint32_t              covered,
+                                 const FragmentShader& frag_shader) const
+{
+    int64_t shade_x = (int64_t(x) << k_subpixel_bits) + k_subpixel_scale / 2;
+    int64_t shade_y = (int64_t(y) << k_subpixel_bits) + k_subpixel_scale / 2;
+
+    bool is_center_inside = true;
+    for (int e = 0; e < 3; ++e)
+    {
+        is_center_inside &=
+            (setup.edge[e].evaluate(shade_x, shade_y) >= setup.edge[e].bias);
+    }
+    if (m_sample_count > 1 && !is_center_inside)
+    {
+        const SamplePosition* sample_pos = getSamplePattern(m_sample_count);
+
+        int first = 0;
+        while (!(covered & (1u << first))) ++first;
+        shade_x = (int64_t(x) << k_subpixel_bits) + sample_pos[first][0];
+        shade_y = (int64_t(y) << k_subpixel_bits) + sample_pos[first][1];
+    }
+
+    float beta =
+        float(setup.edge[1].evaluate(shade_x, shade_y)) * setup.inv_area;
+    float gamma =
+        float(setup.edge[2].evaluate(shade_x, shade_y)) * setup.inv_area;
+    float alpha = 1.0f - beta - gamma;
+
+    float z0_ = alpha * setup.inv_z[0];
+    float z1_ = beta * setup.inv_z[1];
+    float z2_ = gamma * setup.inv_z[2];
+    float zt  = 1.0f / (z0_ + z1_ + z2_);
+
+    FragmentShader::Input input = interpolateInput<getVaryings<FS>()>(
+        *setup.v[0], *setup.v[1], *setup.v[2], z0_, z1_, z2_, zt);
+
+    // The differences across the 2x2 quad of the pixel, as quad shading
+    // gives them, with the texcoords of the other pixels of the quad taken
+    // from the triangle instead of from helper invocations.
+    if constexpr (getVaryings<FS>() &
+                  FragmentShader::k_varying_texcoords_derivatives)
+    {
+        const int       quad_x = x & ~1;
+        const int       quad_y = y & ~1;
+        const glm::vec2 uv     = getTexcoords(setup, quad_x, quad_y);
+        input.texcoords_dx     = getTexcoords(setup, quad_x + 1, quad_y) - uv;
+        input.texcoords_dy     = getTexcoords(setup, quad_x, quad_y + 1) - uv;
+    }
+
+    return invokeShader(static_cast<const FS&>(frag_shader), input);
+}
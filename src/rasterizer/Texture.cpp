@@ -1,92 +1,1065 @@
 #include "Texture.h"
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+#include <glm/gtc/packing.hpp>
+#include <glm/gtc/type_ptr.hpp>
+#include <tbb/tbb.h>
+
+#include "BlockCompression.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#    define TEXTURE_SAMPLER_SSE2
+#    include <emmintrin.h>
+#endif
+#if defined(__F16C__)
+#    include <immintrin.h>
+#endif
+
+// The filter works on whole texels, the 4 channels of a texel are in the
+// lanes of a SSE register.
+#if defined(TEXTURE_SAMPLER_SSE2)
+using Texel = __m128;
+
+static Texel mulTexel(Texel texel, float weight)
+{
+    return _mm_mul_ps(texel, _mm_set1_ps(weight));
+}
+static Texel addTexel(Texel a, Texel b) { return _mm_add_ps(a, b); }
+static glm::vec4 storeTexel(Texel texel)
+{
+    glm::vec4 value;
+    _mm_storeu_ps(&value.x, texel);
+    return value;
+}
+
+// The bytes of packed to the lanes.
+static Texel unpackUnorm8(uint32_t packed)
+{
+    const __m128i zero  = _mm_setzero_si128();
+    __m128i       value = _mm_cvtsi32_si128(int(packed));
+    value               = _mm_unpacklo_epi8(value, zero);
+    value               = _mm_unpacklo_epi16(value, zero);
+    return _mm_mul_ps(_mm_cvtepi32_ps(value), _mm_set1_ps(1.0f / 255.0f));
+}
+static Texel getAlphaFill() { return _mm_setr_ps(0.0f, 0.0f, 0.0f, 1.0f); }
+static Texel unpackHalf(uint64_t packed)
+{
+#    if defined(__F16C__)
+    return _mm_cvtph_ps(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i*>(&packed)));
+#    else
+    const glm::vec4 value = glm::unpackHalf4x16(packed);
+    return _mm_loadu_ps(&value.x);
+#    endif
+}
+#else
+using Texel = glm::vec4;
+
+static Texel     mulTexel(Texel texel, float weight) { return texel * weight; }
+static Texel     addTexel(Texel a, Texel b) { return a + b; }
+static glm::vec4 storeTexel(Texel texel) { return texel; }
+
+static Texel unpackUnorm8(uint32_t packed)
+{
+    return glm::unpackUnorm4x8(packed);
+}
+static Texel getAlphaFill() { return glm::vec4(0.0f, 0.0f, 0.0f, 1.0f); }
+static Texel unpackHalf(uint64_t packed) { return glm::unpackHalf4x16(packed); }
+#endif
+
+template <TextureFormat Format>
+static Texel loadTexel(const uint8_t* texel);
+
+template <>
+Texel loadTexel<TextureFormat::RGBA8>(const uint8_t* texel)
+{
+    uint32_t packed;
+    std::memcpy(&packed, texel, sizeof(packed));
+    return unpackUnorm8(packed);
+}
+
+template <>
+Texel loadTexel<TextureFormat::RG8>(const uint8_t* texel)
+{
+    uint16_t packed;
+    std::memcpy(&packed, texel, sizeof(packed));
+    return addTexel(unpackUnorm8(packed), getAlphaFill());
+}
+
+template <>
+Texel loadTexel<TextureFormat::R8>(const uint8_t* texel)
+{
+    return addTexel(unpackUnorm8(*texel), getAlphaFill());
+}
+
+template <>
+Texel loadTexel<TextureFormat::RGBA16F>(const uint8_t* texel)
+{
+    uint64_t packed;
+    std::memcpy(&packed, texel, sizeof(packed));
+    return unpackHalf(packed);
+}
+
+// The two texels around coord (in texels, from the texel centers) and the
+// weight of the second one. Repeated coords are wrapped before.
+static float getTexelPair(TextureWrap wrap,
+                          float       coord,
+                          int         size,
+                          int&        lo,
+                          int&        hi)
+{
+    const float floor_coord = std::floor(coord);
+    lo                      = int(floor_coord);
+    hi                      = lo + 1;
+    if (wrap == TextureWrap::Repeat)
+    {
+        lo = (lo < 0) ? size - 1 : lo;
+        hi = (hi >= size) ? 0 : hi;
+    }
+    else
+    {
+        lo = std::clamp(lo, 0, size - 1);
+        hi = std::clamp(hi, 0, size - 1);
+    }
+    return coord - floor_coord;
+}
+
+// A small direct mapped cache of decoded blocks per thread. The entries are
+// tagged with the block address and the texture serial, so that a block of a
+// freed texture is never returned for a new one.
+struct DecodedBlockCache
+{
+    static constexpr int k_entry_count = 64;
+
+    struct Entry
+    {
+        const uint8_t* block  = nullptr;
+        uint64_t       serial = 0;
+        uint32_t       texels[k_bc_texel_count];
+    };
+
+    Entry entries[k_entry_count];
+};
+
+static thread_local DecodedBlockCache s_block_cache;
+
+template <TextureFormat Format>
+static const uint32_t* getDecodedBlock(const uint8_t* block, uint64_t serial)
+{
+    constexpr size_t k_block_size = getTextureFormatSize(Format);
+
+    // The blocks below each other are a row pitch apart, which is often a
+    // multiple of the entry count.
+    const size_t block_idx = uintptr_t(block) / k_block_size;
+    DecodedBlockCache::Entry& entry =
+        s_block_cache.entries[(block_idx ^ (block_idx >> 6) ^
+                               (block_idx >> 12)) %
+                              DecodedBlockCache::k_entry_count];
+    if (entry.block == block && entry.serial == serial)
+    {
+        return entry.texels;
+    }
+
+    switch (Format)
+    {
+        case TextureFormat::BC1: decodeBC1Block(block, entry.texels); break;
+        case TextureFormat::BC3: decodeBC3Block(block, entry.texels); break;
+        case TextureFormat::BC4: decodeBC4Block(block, entry.texels); break;
+        default: decodeBC5Block(block, entry.texels); break;
+    }
+    entry.block  = block;
+    entry.serial = serial;
+    return entry.texels;
+}
+
+// Fetches the texels (x, y) of a level.
+template <TextureFormat Format>
+struct TexelFetcher
+{
+    static constexpr size_t k_texel_size = getTextureFormatSize(Format);
+
+    const uint8_t* data;
+    size_t         row_pitch;
+    uint64_t       serial;
+
+    // The last decoded block, the taps of a sample are mostly in one block.
+    const uint8_t*  block  = nullptr;
+    const uint32_t* texels = nullptr;
+
+    Texel operator()(int x, int y)
+    {
+        if constexpr (isCompressedFormat(Format))
+        {
+            const uint8_t* xy_block =
+                data + size_t(y / k_bc_block_size) * row_pitch +
+                size_t(x / k_bc_block_size) * k_texel_size;
+            if (xy_block != block)
+            {
+                block  = xy_block;
+                texels = getDecodedBlock<Format>(block, serial);
+            }
+            return unpackUnorm8(
+                texels[(y % k_bc_block_size) * k_bc_block_size +
+                       (x % k_bc_block_size)]);
+        }
+        else
+        {
+            return loadTexel<Format>(data + size_t(y) * row_pitch +
+                                     size_t(x) * k_texel_size);
+        }
+    }
+};
+
+// Fetches the texels of a streamed level from its resident pages. A texel
+// of a missing page sets missing and requests the page.
+template <TextureFormat Format>
+struct PagedTexelFetcher
+{
+    TexturePages&              pages;
+    const TexturePages::Level& level;
+    uint32_t                   frame;
+
+    bool missing = false;
+
+    // The page of the last texel.
+    size_t                 page_idx = SIZE_MAX;
+    const TexturePageData* page     = nullptr;
+    TexelFetcher<Format>   fetch{ nullptr, 0, 0 };
+
+    Texel operator()(int x, int y)
+    {
+        const size_t xy_page_idx =
+            level.first_page +
+            size_t(y / k_texture_page_size) * level.page_count_x +
+            size_t(x / k_texture_page_size);
+        if (xy_page_idx != page_idx)
+        {
+            page_idx                 = xy_page_idx;
+            TexturePages::Page& data = pages.pages[page_idx];
+
+            // The flags are shared by the threads, they are only written
+            // when they change.
+            page = data.data.load(std::memory_order_acquire);
+            if (page == nullptr)
+            {
+                if (!data.requested.load(std::memory_order_relaxed))
+                {
+                    data.requested.store(true, std::memory_order_relaxed);
+                }
+            }
+            else
+            {
+                if (data.last_used.load(std::memory_order_relaxed) != frame)
+                {
+                    data.last_used.store(frame, std::memory_order_relaxed);
+                }
+                fetch = { page->texels.get(),
+                          pages.page_row_pitch,
+                          page->serial };
+            }
+        }
+
+        if (page == nullptr)
+        {
+            missing = true;
+            return getAlphaFill();
+        }
+        return fetch(x % k_texture_page_size, y % k_texture_page_size);
+    }
+};
+
+// The bilinear sample of the 4 texels around (u, v) of a level, weighted by
+// weight.
+template <typename Fetch>
+static Texel filterBilinear(TextureWrap wrap,
+                            int         width,
+                            int         height,
+                            float       u,
+                            float       v,
+                            float       weight,
+                            Fetch&      fetch)
+{
+    int         x_lo, x_hi, y_lo, y_hi;
+    const float delta_u =
+        getTexelPair(wrap, u * width - 0.5f, width, x_lo, x_hi);
+    const float delta_v =
+        getTexelPair(wrap, v * height - 0.5f, height, y_lo, y_hi);
+    const float d_u_rest = 1.0f - delta_u;
+    const float d_v_rest = 1.0f - delta_v;
+
+    Texel result = mulTexel(fetch(x_lo, y_lo), d_u_rest * d_v_rest * weight);
+    result       = addTexel(
+        result, mulTexel(fetch(x_lo, y_hi), d_u_rest * delta_v * weight));
+    result = addTexel(
+        result, mulTexel(fetch(x_hi, y_hi), delta_u * delta_v * weight));
+    result = addTexel(
+        result, mulTexel(fetch(x_hi, y_lo), delta_u * d_v_rest * weight));
+    return result;
+}
+
+static std::atomic<uint64_t> s_next_serial{ 1 };
+
+// Set once at startup, see Texture::setContainerDirectory().
+static std::string s_container_directory;
+
+// The header of the texture containers, the levels follow at
+// k_container_data_offset.
+struct TextureContainerHeader
+{
+    char     magic[4];
+    uint32_t version;
+    uint32_t format;
+    int32_t  width;
+    int32_t  height;
+    int32_t  level_count;
+    uint64_t data_size;
+};
+
+static constexpr char     k_container_magic[4]    = { 'S', 'R', 'T', 'X' };
+static constexpr uint32_t k_container_version     = 1;
+static constexpr size_t   k_container_data_offset = 64;
+static constexpr int32_t  k_container_max_size    = 1 << 16;
+static_assert(sizeof(TextureContainerHeader) <= k_container_data_offset);
+
+// The header fields are checked before they are used, the size of the data
+// is checked against the file after the levels are laid out.
+static bool isValidHeader(const TextureContainerHeader& header)
+{
+    return !std::memcmp(
+               header.magic, k_container_magic, sizeof(header.magic)) &&
+           header.version == k_container_version &&
+           header.format <= uint32_t(TextureFormat::BC5) &&
+           header.width > 0 && header.width <= k_container_max_size &&
+           header.height > 0 && header.height <= k_container_max_size &&
+           header.level_count >= 0;
+}
 
 Texture::Texture(const std::string& path)
 {
-    int      channel{};
-    stbi_uc* data =
-        stbi_load(path.c_str(), &m_width, &m_height, &channel, STBI_rgb_alpha);
-    if (!data)
+    load(path, nullptr);
+}
+
+Texture::Texture(const std::string& path, TextureFormat format)
+{
+    load(path, &format);
+}
+
+std::shared_ptr<Texture> Texture::createVirtual(
+    const std::string& container_path,
+    TexturePageCache&  cache)
+{
+    std::string file = container_path;
+    if (!std::ifstream(file))
+    {
+        file = "../" + container_path;
+    }
+
+    std::shared_ptr<Texture> texture(new Texture());
+    if (!texture->loadPages(file, cache))
+    {
+        return nullptr;
+    }
+    return texture;
+}
+
+bool Texture::loadPages(const std::string& path, TexturePageCache& cache)
+{
+    m_serial = allocateSerial();
+
+    auto pages = std::make_unique<TexturePages>();
+    pages->file.open(path, std::ios::binary | std::ios::ate);
+    if (!pages->file)
+    {
+        return false;
+    }
+    const size_t file_size = size_t(pages->file.tellg());
+
+    TextureContainerHeader header{};
+    pages->file.seekg(0);
+    pages->file.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!pages->file || !isValidHeader(header))
+    {
+        return false;
+    }
+
+    m_format          = TextureFormat(header.format);
+    m_width           = header.width;
+    m_height          = header.height;
+    const size_t size = layoutLevels(header.level_count);
+    if (size != header.data_size || file_size < k_container_data_offset + size)
+    {
+        return false;
+    }
+
+    const int dim = isCompressedFormat(m_format) ? k_bc_block_size : 1;
+    pages->data_offset    = k_container_data_offset;
+    pages->page_row_count = k_texture_page_size / dim;
+    pages->page_row_pitch =
+        size_t(k_texture_page_size / dim) * getTextureFormatSize(m_format);
+    pages->page_size = pages->page_row_pitch * pages->page_row_count;
+
+    // The levels larger than a page are streamed.
+    for (; m_tail_level < getLevelCount(); ++m_tail_level)
+    {
+        const Level& level = m_levels[m_tail_level];
+        if (level.width <= k_texture_page_size &&
+            level.height <= k_texture_page_size)
+        {
+            break;
+        }
+
+        TexturePages::Level paged;
+        paged.width     = level.width;
+        paged.height    = level.height;
+        paged.offset    = level.offset;
+        paged.row_pitch = level.row_pitch;
+        paged.row_count = (level.height + dim - 1) / dim;
+        paged.page_count_x =
+            (level.width + k_texture_page_size - 1) / k_texture_page_size;
+        paged.page_count_y =
+            (level.height + k_texture_page_size - 1) / k_texture_page_size;
+        paged.first_page = pages->page_count;
+        pages->page_count += size_t(paged.page_count_x) * paged.page_count_y;
+        pages->levels.push_back(paged);
+    }
+    pages->pages = std::make_unique<TexturePages::Page[]>(pages->page_count);
+
+    // The tail levels are moved to the start of m_data.
+    if (m_tail_level < getLevelCount())
+    {
+        const size_t tail_offset = m_levels[m_tail_level].offset;
+        m_data.resize(size - tail_offset);
+        pages->file.seekg(k_container_data_offset + tail_offset);
+        pages->file.read(reinterpret_cast<char*>(m_data.data()),
+                         m_data.size());
+        if (!pages->file)
+        {
+            return false;
+        }
+
+        for (int i = m_tail_level; i < getLevelCount(); ++i)
+        {
+            m_levels[i].offset -= tail_offset;
+        }
+    }
+    m_texels      = m_data.data();
+    m_texels_size = m_data.size();
+
+    m_pages = std::move(pages);
+    cache.addTexture(m_pages.get());
+    return true;
+}
+
+uint64_t Texture::allocateSerial()
+{
+    return s_next_serial++;
+}
+
+void Texture::load(const std::string& path, const TextureFormat* format)
+{
+    m_serial = allocateSerial();
+
+    auto exists = [](const std::string& file) { return !!std::ifstream(file); };
+
+    std::string file = path;
+    if (!exists(file) && !(format && exists(getContainerPath(file, *format))))
+    {
+        file = "../" + path;
+    }
+
+    if (format)
+    {
+        // A container older than its image is out of date.
+        const std::string container = getContainerPath(file, *format);
+        std::error_code   error;
+        const auto        container_time =
+            std::filesystem::last_write_time(container, error);
+        if (!error)
+        {
+            const auto image_time =
+                std::filesystem::last_write_time(file, error);
+            if ((error || image_time <= container_time) &&
+                loadContainer(container))
+            {
+                if (m_format == *format)
+                {
+                    return;
+                }
+                // A container of another format is converted again.
+                m_file.close();
+            }
+        }
+    }
+
+    if (loadContainer(file) || loadDds(file))
+    {
+        return;
+    }
+
+    int channel{};
+    if (stbi_is_hdr(file.c_str()))
+    {
+        float* data = stbi_loadf(
+            file.c_str(), &m_width, &m_height, &channel, STBI_rgb_alpha);
+        assert(data != nullptr);
+
+        m_format = format ? *format : TextureFormat::RGBA16F;
+        buildLevels(
+            [&](int x, int y)
+            {
+                return glm::make_vec4(data +
+                                      ((size_t(y) * m_width + x) << 2));
+            });
+
+        stbi_image_free(data);
+    }
+    else
+    {
+        // Loaded with the channels of the file.
+        stbi_uc* data =
+            stbi_load(file.c_str(), &m_width, &m_height, &channel, 0);
+        assert(data != nullptr);
+
+        m_format = format           ? *format
+                   : (channel == 1) ? TextureFormat::R8
+                   : (channel == 2) ? TextureFormat::RG8
+                                    : TextureFormat::RGBA8;
+        buildLevels(
+            [&](int x, int y)
+            {
+                const stbi_uc* pixel =
+                    data + (size_t(y) * m_width + x) * channel;
+
+                glm::vec4 texel(0.0f, 0.0f, 0.0f, 1.0f);
+                for (int c = 0; c < channel; ++c)
+                {
+                    texel[c] = pixel[c] / 255.0f;
+                }
+                return texel;
+            });
+
+        stbi_image_free(data);
+    }
+}
+
+bool Texture::loadContainer(const std::string& path)
+{
+    MappedFile file;
+    if (!file.open(path) || file.getSize() < k_container_data_offset)
+    {
+        return false;
+    }
+
+    TextureContainerHeader header;
+    std::memcpy(&header, file.getData(), sizeof(header));
+    if (!isValidHeader(header))
+    {
+        return false;
+    }
+
+    m_format = TextureFormat(header.format);
+    m_width  = header.width;
+    m_height = header.height;
+
+    const size_t size = layoutLevels(header.level_count);
+    if (size != header.data_size ||
+        file.getSize() < k_container_data_offset + size)
+    {
+        return false;
+    }
+
+    m_texels      = file.getData() + k_container_data_offset;
+    m_texels_size = size;
+    m_file        = std::move(file);
+    return true;
+}
+
+bool Texture::save(const std::string& path) const
+{
+    assert(!isVirtual());
+
+    TextureContainerHeader header{};
+    std::memcpy(header.magic, k_container_magic, sizeof(header.magic));
+    header.version     = k_container_version;
+    header.format      = uint32_t(m_format);
+    header.width       = m_width;
+    header.height      = m_height;
+    header.level_count = getLevelCount();
+    header.data_size   = m_texels_size;
+
+    const char padding[k_container_data_offset] = {};
+
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(padding, k_container_data_offset - sizeof(header));
+    file.write(reinterpret_cast<const char*>(m_texels), m_texels_size);
+    return bool(file);
+}
+
+std::string Texture::getContainerPath(const std::string& path,
+                                      TextureFormat      format)
+{
+    std::filesystem::path container =
+        path + "." + getTextureFormatName(format) + ".tex";
+    if (!s_container_directory.empty())
+    {
+        container = s_container_directory / container.filename();
+    }
+    return container.string();
+}
+
+void Texture::setContainerDirectory(const std::string& directory)
+{
+    s_container_directory = directory;
+}
+
+bool Texture::loadDds(const std::string& path)
+{
+    auto fourCC = [](const char code[4])
     {
-        std::string new_path = "../" + path;
-        data                 = stbi_load(
-            new_path.c_str(), &m_width, &m_height, &channel, STBI_rgb_alpha);
+        return uint32_t(uint8_t(code[0])) | (uint32_t(uint8_t(code[1])) << 8) |
+               (uint32_t(uint8_t(code[2])) << 16) |
+               (uint32_t(uint8_t(code[3])) << 24);
+    };
+
+    std::ifstream file(path, std::ios::binary);
+    uint32_t      magic = 0;
+    file.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+    if (!file || magic != fourCC("DDS "))
+    {
+        return false;
     }
-    assert(data != nullptr);
 
-    m_data[0].resize(m_width * m_height);
-    for (int x = 0; x < m_width; ++x)
+    // DDS_HEADER, the pixel format starts at the 19th field. Only the block
+    // compressed formats are loaded, which have the DDPF_FOURCC flag.
+    uint32_t header[31];
+    file.read(reinterpret_cast<char*>(header), sizeof(header));
+    if (!file || header[0] != sizeof(header) || !(header[19] & 0x4) ||
+        header[2] == 0 || header[2] > uint32_t(k_container_max_size) ||
+        header[3] == 0 || header[3] > uint32_t(k_container_max_size))
+    {
+        return false;
+    }
+
+    m_height              = int(header[2]);
+    m_width               = int(header[3]);
+    const int level_count = std::max(int(header[6]), 1);
+
+    const uint32_t code = header[20];
+    if (code == fourCC("DXT1"))
+    {
+        m_format = TextureFormat::BC1;
+    }
+    else if (code == fourCC("DXT5"))
+    {
+        m_format = TextureFormat::BC3;
+    }
+    else if (code == fourCC("ATI1") || code == fourCC("BC4U"))
+    {
+        m_format = TextureFormat::BC4;
+    }
+    else if (code == fourCC("ATI2") || code == fourCC("BC5U"))
     {
-        for (int y = 0; y < m_height; ++y)
+        m_format = TextureFormat::BC5;
+    }
+    else if (code == fourCC("DX10"))
+    {
+        // DDS_HEADER_DXT10, the sRGB variants are read as unorm.
+        uint32_t header_dx10[5];
+        file.read(reinterpret_cast<char*>(header_dx10), sizeof(header_dx10));
+        if (!file)
         {
-            size_t idx(y * m_height + x);
-            m_data[0][idx] = glm::vec4(data[(idx << 2)],
-                                       data[(idx << 2) + 1],
-                                       data[(idx << 2) + 2],
-                                       data[(idx << 2) + 3]) *
-                             k_uc_to_float;
+            return false;
         }
+        switch (header_dx10[0])
+        {
+            case 71:
+            case 72: m_format = TextureFormat::BC1; break;
+            case 77:
+            case 78: m_format = TextureFormat::BC3; break;
+            case 80: m_format = TextureFormat::BC4; break;
+            case 83: m_format = TextureFormat::BC5; break;
+            default: return false;
+        }
+    }
+    else
+    {
+        return false;
     }
 
-    stbi_image_free(data);
+    // The levels are stored in order, as in m_data. A short file is checked
+    // before the levels are allocated.
+    const std::streampos data_begin = file.tellg();
+    file.seekg(0, std::ios::end);
+    const std::streamoff data_size = file.tellg() - data_begin;
+    file.seekg(data_begin);
+    if (!file || data_size < std::streamoff(layoutLevels(level_count)))
+    {
+        return false;
+    }
 
+    allocateLevels(level_count);
+    file.read(reinterpret_cast<char*>(m_data.data()), m_data.size());
+    return bool(file);
+}
 
-    // Generate mipmap.
-    for (int i = 1; i < 4; ++i)
+size_t Texture::layoutLevels(int level_count)
+{
+    const size_t size = getTextureFormatSize(m_format);
+    const int    dim  = isCompressedFormat(m_format) ? k_bc_block_size : 1;
+
+    m_levels.clear();
+
+    int    width  = m_width;
+    int    height = m_height;
+    size_t offset = 0;
+    while (true)
     {
-        int width  = (m_width >> i);
-        int height = (m_height >> i);
+        // Rows of texels, or of blocks.
+        const size_t row_pitch = size_t((width + dim - 1) / dim) * size;
+        const size_t row_count = size_t((height + dim - 1) / dim);
 
-        m_data[i].resize(width * height);
+        m_levels.push_back({ width, height, offset, row_pitch });
+        offset += row_pitch * row_count;
+        if ((width == 1 && height == 1) ||
+            int(m_levels.size()) == level_count)
+        {
+            break;
+        }
+        width  = std::max(width >> 1, 1);
+        height = std::max(height >> 1, 1);
+    }
 
-        for (int x = 0; x < width; ++x)
+    return offset;
+}
+
+void Texture::allocateLevels(int level_count)
+{
+    m_data.resize(layoutLevels(level_count));
+    m_texels      = m_data.data();
+    m_texels_size = m_data.size();
+}
+
+template <typename Load>
+void Texture::storeLevel(int level_idx, const Load& load)
+{
+    const Level& level = m_levels[level_idx];
+    uint8_t*     data  = m_data.data() + level.offset;
+
+    // The rows, of blocks or of texels, are stored in parallel.
+    if (isCompressedFormat(m_format))
+    {
+        const int row_count =
+            (level.height + k_bc_block_size - 1) / k_bc_block_size;
+        tbb::parallel_for(
+            tbb::blocked_range<int>(0, row_count),
+            [&](tbb::blocked_range<int> r)
+            { storeBlockRows(level, data, r.begin(), r.end(), load); });
+        return;
+    }
+
+    tbb::parallel_for(tbb::blocked_range<int>(0, level.height),
+                      [&](tbb::blocked_range<int> r)
+                      { storeRows(level, data, r.begin(), r.end(), load); });
+}
+
+template <typename Load>
+void Texture::storeBlockRows(const Level& level,
+                             uint8_t*     data,
+                             int          first,
+                             int          last,
+                             const Load&  load)
+{
+    // The texels past the edges repeat the last ones.
+    for (int row = first; row < last; ++row)
+    {
+        const int y   = row * k_bc_block_size;
+        uint8_t*  dst = data + size_t(row) * level.row_pitch;
+        for (int x = 0; x < level.width; x += k_bc_block_size)
         {
-            for (int y = 0; y < height; ++y)
+            glm::vec4 texels[k_bc_texel_count];
+            for (int i = 0; i < k_bc_texel_count; ++i)
             {
-                int last_x     = (x << 1);
-                int last_y     = (y << 1);
-                int last_width = (width << 1);
-
-                m_data[i][y * width + x] =
-                    (m_data[i - 1][last_width * (last_y) + last_x] +
-                     m_data[i - 1][last_width * (last_y + 1) + last_x] +
-                     m_data[i - 1][last_width * (last_y) + last_x + 1] +
-                     m_data[i - 1][last_width * (last_y + 1) + last_x + 1]) *
-                    0.25f;
+                texels[i] = load(
+                    std::min(x + i % k_bc_block_size, level.width - 1),
+                    std::min(y + i / k_bc_block_size, level.height - 1));
             }
+
+            switch (m_format)
+            {
+                case TextureFormat::BC1: encodeBC1Block(texels, dst); break;
+                case TextureFormat::BC3: encodeBC3Block(texels, dst); break;
+                case TextureFormat::BC4: encodeBC4Block(texels, dst); break;
+                default: encodeBC5Block(texels, dst); break;
+            }
+            dst += getTextureFormatSize(m_format);
         }
     }
 }
 
-glm::vec4 Texture::sample(float u, float v, int mipmap_level) const
+template <typename Load>
+void Texture::storeRows(const Level& level,
+                        uint8_t*     data,
+                        int          first,
+                        int          last,
+                        const Load&  load)
+{
+    for (int y = first; y < last; ++y)
+    {
+        uint8_t* dst = data + size_t(y) * level.row_pitch;
+        for (int x = 0; x < level.width; ++x)
+        {
+            const glm::vec4 texel = load(x, y);
+            switch (m_format)
+            {
+                case TextureFormat::RG8:
+                {
+                    uint16_t packed = glm::packUnorm2x8(glm::vec2(texel));
+                    std::memcpy(dst, &packed, sizeof(packed));
+                    break;
+                }
+                case TextureFormat::R8:
+                {
+                    *dst = glm::packUnorm1x8(texel.r);
+                    break;
+                }
+                case TextureFormat::RGBA16F:
+                {
+                    uint64_t packed = glm::packHalf4x16(texel);
+                    std::memcpy(dst, &packed, sizeof(packed));
+                    break;
+                }
+                default:
+                {
+                    uint32_t packed = glm::packUnorm4x8(texel);
+                    std::memcpy(dst, &packed, sizeof(packed));
+                    break;
+                }
+            }
+            dst += getTextureFormatSize(m_format);
+        }
+    }
+}
+
+template <typename Load>
+void Texture::buildLevels(const Load& load)
 {
-    int width  = (m_width >> mipmap_level);
-    int height = (m_height >> mipmap_level);
+    allocateLevels();
+    storeLevel(0, load);
+
+    std::vector<glm::vec4> last_texels;
+    std::vector<glm::vec4> texels;
+    for (int i = 1; i < getLevelCount(); ++i)
+    {
+        const Level& last  = m_levels[i - 1];
+        const Level& level = m_levels[i];
 
-    u *= width;
-    v *= height;
+        // An odd last texel is averaged with itself.
+        auto loadLast = [&](int x, int y)
+        {
+            x = std::min(x, last.width - 1);
+            y = std::min(y, last.height - 1);
+            return (i == 1) ? load(x, y)
+                            : last_texels[size_t(y) * last.width + x];
+        };
 
-    int x_lo = u;
-    int y_lo = v;
-    x_lo     = std::clamp(x_lo, 0, width - 1);
-    y_lo     = std::clamp(y_lo, 0, height - 1);
-    // return sampleIner(x_lo, y_lo);
+        texels.resize(size_t(level.width) * level.height);
+        tbb::parallel_for(
+            tbb::blocked_range<int>(0, level.height),
+            [&](tbb::blocked_range<int> r)
+            {
+                for (int y = r.begin(); y < r.end(); ++y)
+                {
+                    for (int x = 0; x < level.width; ++x)
+                    {
+                        int last_x = (x << 1);
+                        int last_y = (y << 1);
 
-    int x_hi = std::clamp(x_lo + 1, 0, width - 1);
-    int y_hi = std::clamp(y_lo + 1, 0, height - 1);
+                        texels[size_t(y) * level.width + x] =
+                            (loadLast(last_x, last_y) +
+                             loadLast(last_x, last_y + 1) +
+                             loadLast(last_x + 1, last_y) +
+                             loadLast(last_x + 1, last_y + 1)) *
+                            0.25f;
+                    }
+                }
+            });
 
-    float delta_u = u - x_lo - 0.5f;
-    float delta_v = v - y_lo - 0.5f;
+        storeLevel(i,
+                   [&](int x, int y)
+                   { return texels[size_t(y) * level.width + x]; });
+        std::swap(last_texels, texels);
+    }
+}
 
-    if (delta_u < 0.0f) delta_u += 1.0f;
-    if (delta_v < 0.0f) delta_v += 1.0f;
+template <TextureFormat Format>
+glm::vec4 Texture::filterLevels(float u, float v, int lo, int hi, float t) const
+{
+    if (m_wrap == TextureWrap::Repeat)
+    {
+        u -= std::floor(u);
+        v -= std::floor(v);
+    }
+
+    auto filterLevel = [&](int level_idx, float weight)
+    {
+        const Level&         level = m_levels[level_idx];
+        TexelFetcher<Format> fetch{ m_texels + level.offset,
+                                    level.row_pitch,
+                                    m_serial };
+        return filterBilinear(
+            m_wrap, level.width, level.height, u, v, weight, fetch);
+    };
+
+    if (lo == hi || t == 0.0f)
+    {
+        return storeTexel(filterLevel(lo, 1.0f));
+    }
+    return storeTexel(
+        addTexel(filterLevel(lo, 1.0f - t), filterLevel(hi, t)));
+}
 
-    float d_u_rest = 1.0f - delta_u;
-    float d_v_rest = 1.0f - delta_v;
+template <TextureFormat Format>
+glm::vec4 Texture::filterPagedLevels(float u,
+                                     float v,
+                                     int   lo,
+                                     int   hi,
+                                     float t) const
+{
+    if (m_wrap == TextureWrap::Repeat)
+    {
+        u -= std::floor(u);
+        v -= std::floor(v);
+    }
+
+    TexturePages&  pages = *m_pages;
+    const uint32_t frame = pages.cache->getFrame();
+
+    // Sets missing when a page of a streamed level is not resident.
+    auto filterLevel = [&](int level_idx, float weight, bool& missing)
+    {
+        const Level& level = m_levels[level_idx];
+        if (level_idx >= m_tail_level)
+        {
+            TexelFetcher<Format> fetch{ m_texels + level.offset,
+                                        level.row_pitch,
+                                        m_serial };
+            return filterBilinear(
+                m_wrap, level.width, level.height, u, v, weight, fetch);
+        }
+
+        PagedTexelFetcher<Format> fetch{ pages,
+                                         pages.levels[level_idx],
+                                         frame };
+        const Texel               result = filterBilinear(
+            m_wrap, level.width, level.height, u, v, weight, fetch);
+        missing = fetch.missing;
+        return result;
+    };
+
+    // A missing level is replaced by the next resident one, and the second
+    // level of the blend is dropped when it is missing.
+    for (int level = lo; level < getLevelCount(); ++level)
+    {
+        const bool blend   = (level == lo && lo != hi && t != 0.0f);
+        bool       missing = false;
+        Texel result = filterLevel(level, blend ? 1.0f - t : 1.0f, missing);
+        if (missing)
+        {
+            continue;
+        }
+
+        if (blend)
+        {
+            const Texel hi_result = filterLevel(hi, t, missing);
+            result = missing ? mulTexel(result, 1.0f / (1.0f - t))
+                             : addTexel(result, hi_result);
+        }
+        return storeTexel(result);
+    }
+    return glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+}
+
+glm::vec4 Texture::sampleLevels(float u, float v, int lo, int hi, float t) const
+{
+    if (isVirtual())
+    {
+        switch (m_format)
+        {
+            case TextureFormat::RG8:
+                return filterPagedLevels<TextureFormat::RG8>(u, v, lo, hi, t);
+            case TextureFormat::R8:
+                return filterPagedLevels<TextureFormat::R8>(u, v, lo, hi, t);
+            case TextureFormat::RGBA16F:
+                return filterPagedLevels<TextureFormat::RGBA16F>(
+                    u, v, lo, hi, t);
+            case TextureFormat::BC1:
+                return filterPagedLevels<TextureFormat::BC1>(u, v, lo, hi, t);
+            case TextureFormat::BC3:
+                return filterPagedLevels<TextureFormat::BC3>(u, v, lo, hi, t);
+            case TextureFormat::BC4:
+                return filterPagedLevels<TextureFormat::BC4>(u, v, lo, hi, t);
+            case TextureFormat::BC5:
+                return filterPagedLevels<TextureFormat::BC5>(u, v, lo, hi, t);
+            default:
+                return filterPagedLevels<TextureFormat::RGBA8>(
+                    u, v, lo, hi, t);
+        }
+    }
+
+    switch (m_format)
+    {
+        case TextureFormat::RG8:
+            return filterLevels<TextureFormat::RG8>(u, v, lo, hi, t);
+        case TextureFormat::R8:
+            return filterLevels<TextureFormat::R8>(u, v, lo, hi, t);
+        case TextureFormat::RGBA16F:
+            return filterLevels<TextureFormat::RGBA16F>(u, v, lo, hi, t);
+        case TextureFormat::BC1:
+            return filterLevels<TextureFormat::BC1>(u, v, lo, hi, t);
+        case TextureFormat::BC3:
+            return filterLevels<TextureFormat::BC3>(u, v, lo, hi, t);
+        case TextureFormat::BC4:
+            return filterLevels<TextureFormat::BC4>(u, v, lo, hi, t);
+        case TextureFormat::BC5:
+            return filterLevels<TextureFormat::BC5>(u, v, lo, hi, t);
+        default: return filterLevels<TextureFormat::RGBA8>(u, v, lo, hi, t);
+    }
+}
+
+glm::vec4 Texture::sample(float u, float v, int mipmap_level) const
+{
+    return sampleLevels(u, v, mipmap_level, mipmap_level, 0.0f);
+}
+
+glm::vec4 Texture::sample(float            u,
+                          float            v,
+                          const glm::vec2& duv_dx,
+                          const glm::vec2& duv_dy) const
+{
+    // Footprint of the pixel in texels, squared.
+    const glm::vec2 size(m_width, m_height);
+    const glm::vec2 dx = duv_dx * size;
+    const glm::vec2 dy = duv_dy * size;
+    const float     rho2 = std::max(glm::dot(dx, dx), glm::dot(dy, dy));
+
+    // Magnified, or no derivatives.
+    if (!(rho2 > 1.0f))
+    {
+        return sampleLevels(u, v, 0, 0, 0.0f);
+    }
 
-    return d_u_rest * d_v_rest * sampleIner(x_lo, y_lo, mipmap_level) +
-           d_u_rest * delta_v * sampleIner(x_lo, y_hi, mipmap_level) +
-           delta_u * delta_v * sampleIner(x_hi, y_hi, mipmap_level) +
-           delta_u * d_v_rest * sampleIner(x_hi, y_lo, mipmap_level);
+    const int   max_level = getLevelCount() - 1;
+    const float lod       = std::min(0.5f * std::log2(rho2), float(max_level));
+    const int   lo        = int(lod);
+    const int   hi        = std::min(lo + 1, max_level);
+    const float t         = lod - float(lo);
+    return sampleLevels(u, v, lo, hi, t);
 }
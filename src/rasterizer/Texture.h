@@ -1,4 +1,6 @@
 #pragma once
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -6,32 +8,209 @@
 
 #include <glm/glm.hpp>
 
-class Texture
+#include "TexturePageCache.h"
+#include "utils/MappedFile.h"
+
+// Storage formats of the texels. The texels are decoded to floats only when
+// they are filtered; a missing channel reads as 0, a missing alpha as 1.
+enum class TextureFormat
 {
-private:
-    static constexpr float k_uc_to_float = 1.0f / 255.0f;
+    RGBA8 = 0,  // Unorm, red in the first byte.
+    RG8,        // Unorm.
+    R8,         // Unorm.
+    RGBA16F,    // 4 half floats, for HDR images.
+    BC1,        // RGB and 1 bit alpha, 4x4 texels in 8 bytes.
+    BC3,        // RGBA, 4x4 texels in 16 bytes.
+    BC4,        // Red, 4x4 texels in 8 bytes.
+    BC5         // Red and green, 4x4 texels in 16 bytes.
+};
+
+// How the texcoords outside [0, 1] are mapped to the texture.
+enum class TextureWrap
+{
+    Clamp = 0,  // To the edge texels.
+    Repeat
+};
+
+// The formats made of 4x4 blocks.
+static constexpr bool isCompressedFormat(TextureFormat format)
+{
+    return format >= TextureFormat::BC1;
+}
+
+// The size of a texel, or of a block for the compressed formats.
+static constexpr size_t getTextureFormatSize(TextureFormat format)
+{
+    switch (format)
+    {
+        case TextureFormat::RG8: return 2;
+        case TextureFormat::R8: return 1;
+        case TextureFormat::RGBA16F: return 8;
+        case TextureFormat::BC1: return 8;
+        case TextureFormat::BC3: return 16;
+        case TextureFormat::BC4: return 8;
+        case TextureFormat::BC5: return 16;
+        default: return 4;
+    }
+}
+
+// The lower case name, e.g. "bc5".
+static constexpr const char* getTextureFormatName(TextureFormat format)
+{
+    switch (format)
+    {
+        case TextureFormat::RG8: return "rg8";
+        case TextureFormat::R8: return "r8";
+        case TextureFormat::RGBA16F: return "rgba16f";
+        case TextureFormat::BC1: return "bc1";
+        case TextureFormat::BC3: return "bc3";
+        case TextureFormat::BC4: return "bc4";
+        case TextureFormat::BC5: return "bc5";
+        default: return "rgba8";
+    }
+}
 
+static constexpr int getTextureChannelCount(TextureFormat format)
+{
+    switch (format)
+    {
+        case TextureFormat::RG8:
+        case TextureFormat::BC5: return 2;
+        case TextureFormat::R8:
+        case TextureFormat::BC4: return 1;
+        default: return 4;
+    }
+}
+
+class Texture
+{
 public:
+    // Texture containers (see save()) are mapped, DDS files keep the format
+    // and the levels they contain. For images, the format is picked from the
+    // image: HDR images are stored in RGBA16F, the others in the 8 bit format
+    // with as many channels as the file.
     Texture(const std::string& path);
+    // Maps the container of the image in format when it is up to date,
+    // otherwise the image is converted to format, and compressed when it is a
+    // block format.
+    Texture(const std::string& path, TextureFormat format);
     Texture(const Texture&)            = delete;
     Texture& operator=(const Texture&) = delete;
     Texture(Texture&&)                 = default;
     Texture& operator=(Texture&&)      = default;
 
-    // u and v should be in [0, 1].
+    // Bilinear sample, u and v are mapped by the wrap mode.
     glm::vec4 sample(float u, float v, int mipmap_level) const;
+    // Trilinear sample, the mipmap level is selected from the screen space
+    // derivatives of u and v.
+    glm::vec4 sample(float            u,
+                     float            v,
+                     const glm::vec2& duv_dx,
+                     const glm::vec2& duv_dy) const;
+
+    void        setWrap(TextureWrap wrap) { m_wrap = wrap; }
+    TextureWrap getWrap() const { return m_wrap; }
+
+    TextureFormat getFormat() const { return m_format; }
+    int           getWidth() const { return m_width; }
+    int           getHeight() const { return m_height; }
+    // The chain goes down to 1x1, except for files with less levels.
+    int           getLevelCount() const { return int(m_levels.size()); }
+    // Without the pages of a virtual texture, which are in its cache.
+    size_t        getMemorySize() const { return m_texels_size; }
+    bool          isVirtual() const { return m_pages != nullptr; }
+
+    // Writes the texture container: a header followed by the levels in the
+    // layout of the sampler, so that it is mapped and sampled without copies.
+    bool save(const std::string& path) const;
+    // A virtual texture read from a container, see save(). Its levels larger
+    // than a page are streamed by cache, a missing page is replaced by the
+    // coarser levels until it is loaded. Returns nullptr when the container
+    // is missing or invalid.
+    static std::shared_ptr<Texture> createVirtual(
+        const std::string& container_path,
+        TexturePageCache&  cache);
+    // Where the container of the image in format is looked for: in the
+    // container directory if one is set, otherwise next to the image.
+    static std::string getContainerPath(const std::string& path,
+                                        TextureFormat      format);
+    // The directory of the containers, e.g. in the build tree. Set before
+    // any texture is loaded.
+    static void setContainerDirectory(const std::string& directory);
+
+    // Identifies texels in the decoded block caches, see m_serial.
+    static uint64_t allocateSerial();
 
 private:
-    glm::vec4 sampleIner(int x, int y, int mipmap_level) const
+    Texture() = default;
+
+    struct Level
     {
-        assert(mipmap_level >= 0);
-        assert(mipmap_level < 4);
+        int    width     = 0;
+        int    height    = 0;
+        size_t offset    = 0;  // In bytes, into m_texels if resident.
+        size_t row_pitch = 0;  // In bytes, of texels or of blocks.
+    };
 
-        return m_data[mipmap_level][size_t(y * (m_width >> mipmap_level) + x)];
-    }
+    // Blends the bilinear samples of two levels, t is the weight of the
+    // second one.
+    glm::vec4 sampleLevels(float u, float v, int lo, int hi, float t) const;
+    template <TextureFormat Format>
+    glm::vec4 filterLevels(float u, float v, int lo, int hi, float t) const;
+    template <TextureFormat Format>
+    glm::vec4 filterPagedLevels(float u,
+                                float v,
+                                int   lo,
+                                int   hi,
+                                float t) const;
+
+    void load(const std::string& path, const TextureFormat* format);
+    // They return false when the file is not a container or a DDS file.
+    bool loadContainer(const std::string& path);
+    bool loadDds(const std::string& path);
+    // Reads the tail levels of a virtual texture and sets up its pages.
+    bool loadPages(const std::string& path, TexturePageCache& cache);
+
+    // Lays out level_count levels, or the levels down to 1x1, and returns
+    // their size.
+    size_t layoutLevels(int level_count = 0);
+    // The texels are in m_data when they are not mapped.
+    void allocateLevels(int level_count = 0);
+    // The level 0 is read from load(x, y), the next levels are box filtered
+    // from the previous one and kept in floats until they are stored.
+    template <typename Load>
+    void buildLevels(const Load& load);
+    template <typename Load>
+    void storeLevel(int level, const Load& load);
+    template <typename Load>
+    void storeBlockRows(const Level& level,
+                        uint8_t*     data,
+                        int          first,
+                        int          last,
+                        const Load&  load);
+    template <typename Load>
+    void storeRows(const Level& level,
+                   uint8_t*     data,
+                   int          first,
+                   int          last,
+                   const Load&  load);
 
 private:
-    int                    m_width  = 0;
-    int                    m_height = 0;
-    std::vector<glm::vec4> m_data[4];
-};
\ No newline at end of file
+    TextureFormat        m_format = TextureFormat::RGBA8;
+    TextureWrap          m_wrap   = TextureWrap::Clamp;
+    int                  m_width  = 0;
+    int                  m_height = 0;
+    std::vector<Level>   m_levels;
+    std::vector<uint8_t> m_data;
+    MappedFile           m_file;
+    const uint8_t*       m_texels      = nullptr;
+    size_t               m_texels_size = 0;
+
+    // Identifies the texture in the decoded block caches.
+    uint64_t m_serial = 0;
+
+    // The levels before m_tail_level are streamed in virtual textures, the
+    // tail levels are in m_data.
+    std::unique_ptr<TexturePages> m_pages;
+    int                           m_tail_level = 0;
+};
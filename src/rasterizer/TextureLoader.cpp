@@ -0,0 +1,62 @@
+#include "TextureLoader.h"
+#include <filesystem>
+
+TextureLoader::~TextureLoader()
+{
+    m_tasks.wait();
+}
+
+TextureHandle TextureLoader::load(const std::string& path)
+{
+    return request(path, std::nullopt);
+}
+
+TextureHandle TextureLoader::load(const std::string& path, TextureFormat format)
+{
+    return request(path, format);
+}
+
+void TextureLoader::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_textures.clear();
+}
+
+TextureHandle TextureLoader::request(const std::string&                  path,
+                                     const std::optional<TextureFormat>& format)
+{
+    // The same file may be named by different paths.
+    std::error_code error;
+    std::string     key =
+        std::filesystem::weakly_canonical(path, error).string();
+    if (error)
+    {
+        key = path;
+    }
+    if (format)
+    {
+        key += std::string(":") + getTextureFormatName(*format);
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_textures.find(key);
+    if (it != m_textures.end())
+    {
+        return it->second;
+    }
+
+    auto promise =
+        std::make_shared<std::promise<std::shared_ptr<const Texture>>>();
+    TextureHandle handle = promise->get_future().share();
+    m_textures.emplace(key, handle);
+
+    m_arena.enqueue(m_tasks.defer(
+        [promise, path, format]()
+        {
+            promise->set_value(
+                format ? std::make_shared<const Texture>(path, *format)
+                       : std::make_shared<const Texture>(path));
+        }));
+    return handle;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+#include <tbb/task_arena.h>
+#include <tbb/task_group.h>
+
+#include "Texture.h"
+
+using TextureHandle = std::shared_future<std::shared_ptr<const Texture>>;
+
+// Loads the textures on the TBB pool, the levels of a texture are built in
+// parallel as well. A path is loaded once per format: the later requests
+// share the handle of the first one, until clear() is called.
+class TextureLoader
+{
+public:
+    static TextureLoader& getInstance()
+    {
+        static TextureLoader instance;
+        return instance;
+    }
+
+    ~TextureLoader();
+
+    // See the constructors of Texture.
+    TextureHandle load(const std::string& path);
+    TextureHandle load(const std::string& path, TextureFormat format);
+
+    // Forgets the loaded textures, the handles keep theirs alive.
+    void clear();
+
+private:
+    TextureLoader() = default;
+
+    TextureHandle request(const std::string&                  path,
+                          const std::optional<TextureFormat>& format);
+
+private:
+    std::mutex                                     m_mutex;
+    std::unordered_map<std::string, TextureHandle> m_textures;
+    // The tasks are enqueued into the arena, so that they run even when the
+    // caller blocks on a handle and is the only thread of the pool.
+    tbb::task_group                                m_tasks;
+    tbb::task_arena                                m_arena;
+};
@@ -0,0 +1,208 @@
+#include "TexturePageCache.h"
+#include <algorithm>
+
+#include <tbb/tbb.h>
+
+#include "Texture.h"
+
+TexturePages::~TexturePages()
+{
+    if (cache)
+    {
+        cache->removeTexture(this);
+    }
+}
+
+void TexturePageCache::addTexture(TexturePages* pages)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    pages->cache = this;
+    m_textures.push_back(pages);
+}
+
+void TexturePageCache::removeTexture(TexturePages* pages)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_textures.erase(std::remove(m_textures.begin(), m_textures.end(), pages),
+                     m_textures.end());
+    for (size_t i = 0; i < pages->page_count; ++i)
+    {
+        if (pages->pages[i].owned)
+        {
+            m_resident_size -= pages->page_size;
+        }
+    }
+}
+
+// Reads the page (x, y) of level. The texels of the page past the level are
+// not read, the sampler never fetches them. Returns false when the file could
+// not be read, the page stays missing then.
+static bool readPage(TexturePages&              pages,
+                     const TexturePages::Level& level,
+                     int                        x,
+                     int                        y,
+                     uint8_t*                   texels)
+{
+    const int first_row = y * pages.page_row_count;
+    const int row_count =
+        std::min(pages.page_row_count, level.row_count - first_row);
+    const size_t column = size_t(x) * pages.page_row_pitch;
+    const size_t size =
+        std::min(pages.page_row_pitch, level.row_pitch - column);
+
+    std::lock_guard<std::mutex> lock(pages.file_mutex);
+    pages.file.clear();
+    for (int row = 0; row < row_count && pages.file; ++row)
+    {
+        pages.file.seekg(pages.data_offset + level.offset +
+                         size_t(first_row + row) * level.row_pitch + column);
+        uint8_t* dst = texels + size_t(row) * pages.page_row_pitch;
+        pages.file.read(reinterpret_cast<char*>(dst), size);
+    }
+    return bool(pages.file);
+}
+
+void TexturePageCache::update()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const uint32_t frame = m_frame.load(std::memory_order_relaxed);
+
+    // The frames which could sample the retired pages are done.
+    while (!m_retired.empty() &&
+           frame - m_retired.front().frame >= uint32_t(m_desc.retire_delay))
+    {
+        m_retired.pop_front();
+    }
+
+    struct Request
+    {
+        TexturePages*              texture;
+        const TexturePages::Level* level;
+        int                        level_idx;
+        int                        x;
+        int                        y;
+    };
+    std::vector<Request> requests;
+    for (TexturePages* texture : m_textures)
+    {
+        for (size_t i = 0; i < texture->levels.size(); ++i)
+        {
+            const TexturePages::Level& level = texture->levels[i];
+            for (int y = 0; y < level.page_count_y; ++y)
+            {
+                for (int x = 0; x < level.page_count_x; ++x)
+                {
+                    TexturePages::Page& page =
+                        texture->pages[level.first_page +
+                                       size_t(y) * level.page_count_x + x];
+                    if (page.requested.load(std::memory_order_relaxed) &&
+                        page.requested.exchange(false,
+                                                std::memory_order_relaxed) &&
+                        !page.owned)
+                    {
+                        requests.push_back({ texture, &level, int(i), x, y });
+                    }
+                }
+            }
+        }
+    }
+
+    // The coarse levels first, they replace the missing finer pages. The
+    // requests left are made again by the next frames.
+    std::stable_sort(requests.begin(),
+                     requests.end(),
+                     [](const Request& a, const Request& b)
+                     { return a.level_idx > b.level_idx; });
+    if (requests.size() > size_t(m_desc.max_loads))
+    {
+        requests.resize(m_desc.max_loads);
+    }
+
+    size_t size = 0;
+    for (const Request& request : requests)
+    {
+        size += request.texture->page_size;
+    }
+
+    // Makes room by evicting the least recently used pages, except the ones
+    // of the last frame, which are sampled again most likely.
+    if (m_resident_size + size > m_desc.budget)
+    {
+        struct Resident
+        {
+            TexturePages::Page* page;
+            size_t              size;
+            uint32_t            last_used;
+        };
+        std::vector<Resident> residents;
+        for (TexturePages* texture : m_textures)
+        {
+            for (size_t i = 0; i < texture->page_count; ++i)
+            {
+                TexturePages::Page& page = texture->pages[i];
+                const uint32_t      last_used =
+                    page.last_used.load(std::memory_order_relaxed);
+                if (page.owned && last_used + 1 < frame)
+                {
+                    residents.push_back(
+                        { &page, texture->page_size, last_used });
+                }
+            }
+        }
+        std::sort(residents.begin(),
+                  residents.end(),
+                  [](const Resident& a, const Resident& b)
+                  { return a.last_used < b.last_used; });
+
+        for (const Resident& resident : residents)
+        {
+            if (m_resident_size + size <= m_desc.budget)
+            {
+                break;
+            }
+            resident.page->data.store(nullptr, std::memory_order_release);
+            m_retired.push_back({ frame, std::move(resident.page->owned) });
+            m_resident_size -= resident.size;
+        }
+
+        while (!requests.empty() && m_resident_size + size > m_desc.budget)
+        {
+            size -= requests.back().texture->page_size;
+            requests.pop_back();
+        }
+    }
+
+    std::atomic<size_t> failed_size{ 0 };
+    tbb::parallel_for(
+        size_t(0),
+        requests.size(),
+        [&](size_t i)
+        {
+            const Request& request = requests[i];
+            TexturePages&  texture = *request.texture;
+
+            auto data    = std::make_unique<TexturePageData>();
+            data->serial = Texture::allocateSerial();
+            data->texels = std::make_unique<uint8_t[]>(texture.page_size);
+            if (!readPage(texture,
+                          *request.level,
+                          request.x,
+                          request.y,
+                          data->texels.get()))
+            {
+                failed_size += texture.page_size;
+                return;
+            }
+
+            TexturePages::Page& page =
+                texture.pages[request.level->first_page +
+                              size_t(request.y) * request.level->page_count_x +
+                              request.x];
+            page.last_used.store(frame, std::memory_order_relaxed);
+            page.data.store(data.get(), std::memory_order_release);
+            page.owned = std::move(data);
+        });
+    m_resident_size += size - failed_size;
+
+    m_frame.store(frame + 1, std::memory_order_relaxed);
+}
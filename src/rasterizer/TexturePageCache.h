@@ -0,0 +1,121 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// The pages of the virtual textures are k_texture_page_size^2 texels, a
+// multiple of the compressed block size.
+static constexpr int k_texture_page_size = 128;
+
+class TexturePageCache;
+
+// The texels of a resident page, in rows of texels or of blocks. The serial
+// tags its blocks in the decoded block caches, as the memory of an evicted
+// page is reused.
+struct TexturePageData
+{
+    uint64_t                   serial = 0;
+    std::unique_ptr<uint8_t[]> texels;
+};
+
+// The paging state of a virtual texture, owned by the texture. The levels
+// larger than a page are streamed, the smaller ones are always resident.
+struct TexturePages
+{
+    struct Page
+    {
+        // Published by the cache, read by the sampler.
+        std::atomic<const TexturePageData*> data{ nullptr };
+        // The cache frame of the last sample, for the LRU eviction.
+        std::atomic<uint32_t> last_used{ 0 };
+        // Set by the sampler when the page was missing, the feedback of the
+        // cache.
+        std::atomic<bool> requested{ false };
+
+        std::unique_ptr<TexturePageData> owned;  // Only used by the cache.
+    };
+
+    struct Level
+    {
+        int    width        = 0;
+        int    height       = 0;
+        size_t offset       = 0;  // In the container data.
+        size_t row_pitch    = 0;
+        int    row_count    = 0;  // Of texels or of blocks.
+        int    page_count_x = 0;
+        int    page_count_y = 0;
+        size_t first_page   = 0;
+    };
+
+    TexturePages() = default;
+    TexturePages(const TexturePages&)            = delete;
+    TexturePages& operator=(const TexturePages&) = delete;
+    ~TexturePages();
+
+    TexturePageCache* cache = nullptr;
+
+    std::ifstream file;
+    std::mutex    file_mutex;
+    size_t        data_offset = 0;  // Of the levels in the file.
+
+    std::vector<Level>      levels;  // The streamed ones.
+    std::unique_ptr<Page[]> pages;
+    size_t                  page_count     = 0;
+    size_t                  page_size      = 0;  // In bytes.
+    size_t                  page_row_pitch = 0;
+    int                     page_row_count = 0;
+};
+
+// The pages of the virtual textures share a memory budget. The sampler only
+// reads the resident pages and flags the missing ones, update() loads them
+// between the frames and evicts the least recently used pages to make room.
+class TexturePageCache
+{
+public:
+    struct Desc
+    {
+        size_t budget = size_t(64) << 20;  // Bytes of resident pages.
+        // The updates before the memory of an evicted page is freed, the
+        // frames still sampling it may be in flight meanwhile.
+        int retire_delay = 2;
+        int max_loads    = 64;  // Pages loaded per update.
+    };
+
+    TexturePageCache(const Desc& desc) : m_desc(desc) {}
+    TexturePageCache(const TexturePageCache&)            = delete;
+    TexturePageCache& operator=(const TexturePageCache&) = delete;
+
+    // Loads the pages requested since the last update, coarse levels first,
+    // and starts a new frame. Draws may sample the textures meanwhile.
+    void update();
+
+    uint32_t getFrame() const
+    {
+        return m_frame.load(std::memory_order_relaxed);
+    }
+    size_t getResidentSize() const { return m_resident_size; }
+
+    // By the virtual textures, a texture is removed with its pages.
+    void addTexture(TexturePages* pages);
+    void removeTexture(TexturePages* pages);
+
+private:
+    struct Retired
+    {
+        uint32_t                         frame;
+        std::unique_ptr<TexturePageData> data;
+    };
+
+    Desc m_desc;
+
+    std::mutex                 m_mutex;
+    std::vector<TexturePages*> m_textures;
+    std::deque<Retired>        m_retired;
+    size_t                     m_resident_size = 0;
+    std::atomic<uint32_t>      m_frame{ 1 };
+};
@@ -0,0 +1,48 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// The tiled layout of the render targets: every tile of
+// k_layout_tile_size^2 pixels is contiguous, the blocks of
+// k_layout_block_size^2 pixels are in Morton order inside a tile, and the
+// pixels are in rows inside a block. A row of a block, a block and a tile all
+// cover a contiguous range of memory. The buffers are padded to whole tiles.
+static constexpr int k_layout_tile_bits  = 6;
+static constexpr int k_layout_block_bits = 3;
+static constexpr int k_layout_tile_size  = 1 << k_layout_tile_bits;
+static constexpr int k_layout_block_size = 1 << k_layout_block_bits;
+
+// Interleave with zeros the 3 low bits of v.
+static constexpr uint32_t spreadBits3(uint32_t v)
+{
+    return (v & 1u) | ((v & 2u) << 1) | ((v & 4u) << 2);
+}
+
+inline size_t getTiledIdx(int x, int y, int tile_count_x)
+{
+    constexpr int k_block_mask =
+        (1 << (k_layout_tile_bits - k_layout_block_bits)) - 1;
+    constexpr int k_pixel_mask = k_layout_block_size - 1;
+
+    const size_t tile = size_t(y >> k_layout_tile_bits) * tile_count_x +
+                        (x >> k_layout_tile_bits);
+
+    const uint32_t block_x = (x >> k_layout_block_bits) & k_block_mask;
+    const uint32_t block_y = (y >> k_layout_block_bits) & k_block_mask;
+    const uint32_t block   = spreadBits3(block_x) | (spreadBits3(block_y) << 1);
+    const uint32_t pixel   =
+        ((y & k_pixel_mask) << k_layout_block_bits) | (x & k_pixel_mask);
+
+    return (tile << (2 * k_layout_tile_bits)) |
+           (block << (2 * k_layout_block_bits)) | pixel;
+}
+
+inline size_t getTiledBufferSize(int width, int height)
+{
+    const size_t tile_count_x =
+        (width + k_layout_tile_size - 1) / k_layout_tile_size;
+    const size_t tile_count_y =
+        (height + k_layout_tile_size - 1) / k_layout_tile_size;
+    return tile_count_x * tile_count_y * k_layout_tile_size *
+           k_layout_tile_size;
+}
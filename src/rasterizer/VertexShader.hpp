@@ -8,6 +8,14 @@
 #include "geometry/Vertex.h"
 #include "utils/Utils.hpp"
 
+// The vertex attributes declared by the vertex shader type Shader. The type
+// tag keeps a shader from using the set of its parent shader.
+template <typename Shader>
+struct AttributeSet
+{
+    uint32_t mask;
+};
+
 struct VertexShader
 {
     struct Output
@@ -26,11 +34,44 @@ struct VertexShader
         glm::vec3 tangent_space_frag_pos;
     };
 
+    // The Vertex members a shader reads, the others are not fetched from the
+    // vertex buffer and stay zero. Every shader type declares its own set,
+    // render() does not compile with the set of a parent shader.
+    static constexpr AttributeSet<VertexShader> k_attributes{
+        Vertex::k_attribute_all
+    };
+
     virtual Output operator()(const Vertex& vertex) const = 0;
 };
 
-struct VSMvp : public VertexShader
+// The vertex transform of the depth only draws, see
+// Rasterizer::renderDepth(). The clip position and the depth, as stored in
+// mv_position.z by the vertex shaders, are both linear in the position.
+struct DepthTransform
+{
+    struct Output
+    {
+        glm::vec4 mvp_position;
+        float     depth;
+    };
+
+    glm::mat4 mvp;
+    glm::vec4 depth;  // The row of the depth.
+
+    Output operator()(const glm::vec3& position) const
+    {
+        const glm::vec4 p(position, 1.0f);
+        return { mvp * p, glm::dot(depth, p) };
+    }
+};
+
+struct VSMvp final : public VertexShader
 {
+    static constexpr AttributeSet<VSMvp> k_attributes{
+        Vertex::k_attribute_position | Vertex::k_attribute_normal |
+        Vertex::k_attribute_basecolor | Vertex::k_attribute_texcoords
+    };
+
     glm::mat4 mat_model;
     glm::mat4 mat_view;
     glm::mat4 mat_proj;
@@ -56,8 +97,13 @@ struct VSMvp : public VertexShader
     }
 };
 
-struct VSMvpLight : public VertexShader
+struct VSMvpLight final : public VertexShader
 {
+    static constexpr AttributeSet<VSMvpLight> k_attributes{
+        Vertex::k_attribute_position | Vertex::k_attribute_normal |
+        Vertex::k_attribute_basecolor | Vertex::k_attribute_texcoords
+    };
+
     glm::mat4 mat_model;
     glm::mat4 mat_view;
     glm::mat4 mat_proj;
@@ -88,8 +134,12 @@ struct VSMvpLight : public VertexShader
     }
 };
 
-struct VSShadow : public VertexShader
+struct VSShadow final : public VertexShader
 {
+    static constexpr AttributeSet<VSShadow> k_attributes{
+        Vertex::k_attribute_position
+    };
+
     glm::mat4 mat_model;
     glm::mat4 mat_light_view;
     glm::mat4 mat_light_proj;
@@ -107,10 +157,28 @@ struct VSShadow : public VertexShader
 
         return output;
     }
+
+    // The same positions and depths, for the depth only draws.
+    DepthTransform getDepthTransform() const
+    {
+        const glm::mat4 mv = mat_light_view * mat_model;
+
+        DepthTransform transform;
+        transform.mvp   = mat_light_proj * mv;
+        transform.depth = -glm::vec4(mv[0][2], mv[1][2], mv[2][2], mv[3][2]) /
+                          k_max_real_depth;
+        return transform;
+    }
 };
 
-struct VSNormalMapping : public VertexShader
+struct VSNormalMapping final : public VertexShader
 {
+    static constexpr AttributeSet<VSNormalMapping> k_attributes{
+        Vertex::k_attribute_position | Vertex::k_attribute_normal |
+        Vertex::k_attribute_tangent | Vertex::k_attribute_basecolor |
+        Vertex::k_attribute_texcoords
+    };
+
     glm::mat4 mat_model;
     glm::mat4 mat_view;
     glm::mat4 mat_proj;
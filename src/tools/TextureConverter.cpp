@@ -0,0 +1,74 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+#include "rasterizer/Texture.h"
+
+// Converts images to texture containers, written to the container
+// directory, which are mapped by Texture instead of decoding the images at
+// startup.
+//
+// texture_converter <format> <container dir> <image>...
+int main(int argc, char** argv)
+{
+    if (argc < 4)
+    {
+        std::printf(
+            "Usage: texture_converter <format> <container dir> <image>...\n");
+        return 1;
+    }
+
+    constexpr TextureFormat k_formats[] = {
+        TextureFormat::RGBA8, TextureFormat::RG8, TextureFormat::R8,
+        TextureFormat::RGBA16F, TextureFormat::BC1, TextureFormat::BC3,
+        TextureFormat::BC4, TextureFormat::BC5,
+    };
+    const TextureFormat* format = std::find_if(
+        std::begin(k_formats),
+        std::end(k_formats),
+        [&](TextureFormat f)
+        { return !std::strcmp(getTextureFormatName(f), argv[1]); });
+    if (format == std::end(k_formats))
+    {
+        std::printf("Unknown format %s.\n", argv[1]);
+        return 1;
+    }
+
+    std::error_code error;
+    std::filesystem::create_directories(argv[2], error);
+    if (error)
+    {
+        std::printf("Can't create %s.\n", argv[2]);
+        return 1;
+    }
+    Texture::setContainerDirectory(argv[2]);
+
+    for (int i = 3; i < argc; ++i)
+    {
+        if (!std::filesystem::exists(argv[i]))
+        {
+            std::printf("Can't find %s.\n", argv[i]);
+            return 1;
+        }
+
+        // The old container would be mapped instead of the image.
+        const std::string container =
+            Texture::getContainerPath(argv[i], *format);
+        std::filesystem::remove(container);
+
+        Texture texture(argv[i], *format);
+        if (!texture.save(container))
+        {
+            std::printf("Failed to write %s.\n", container.c_str());
+            return 1;
+        }
+        std::printf("%s: %dx%d, %d levels, %zu bytes.\n",
+                    container.c_str(),
+                    texture.getWidth(),
+                    texture.getHeight(),
+                    texture.getLevelCount(),
+                    texture.getMemorySize());
+    }
+    return 0;
+}
@@ -0,0 +1,142 @@
+#include "MappedFile.h"
+#include <utility>
+
+#if defined(_WIN32)
+#    define WIN32_LEAN_AND_MEAN
+#    define NOMINMAX
+#    include <windows.h>
+#else
+#    include <fcntl.h>
+#    include <sys/mman.h>
+#    include <sys/stat.h>
+#    include <unistd.h>
+#endif
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+{
+    *this = std::move(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept
+{
+    if (this != &other)
+    {
+        close();
+        std::swap(m_data, other.m_data);
+        std::swap(m_size, other.m_size);
+#if defined(_WIN32)
+        std::swap(m_file, other.m_file);
+        std::swap(m_mapping, other.m_mapping);
+#endif
+    }
+    return *this;
+}
+
+#if defined(_WIN32)
+bool MappedFile::open(const std::string& path)
+{
+    close();
+
+    m_file = CreateFileA(path.c_str(),
+                         GENERIC_READ,
+                         FILE_SHARE_READ,
+                         nullptr,
+                         OPEN_EXISTING,
+                         FILE_ATTRIBUTE_NORMAL,
+                         nullptr);
+    if (m_file == INVALID_HANDLE_VALUE)
+    {
+        m_file = nullptr;
+        return false;
+    }
+
+    LARGE_INTEGER size{};
+    if (!GetFileSizeEx(m_file, &size) || size.QuadPart == 0)
+    {
+        close();
+        return false;
+    }
+
+    m_mapping =
+        CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!m_mapping)
+    {
+        close();
+        return false;
+    }
+
+    m_data = static_cast<const uint8_t*>(
+        MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!m_data)
+    {
+        close();
+        return false;
+    }
+    m_size = size_t(size.QuadPart);
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (m_data)
+    {
+        UnmapViewOfFile(m_data);
+    }
+    if (m_mapping)
+    {
+        CloseHandle(m_mapping);
+    }
+    if (m_file)
+    {
+        CloseHandle(m_file);
+    }
+    m_data    = nullptr;
+    m_size    = 0;
+    m_mapping = nullptr;
+    m_file    = nullptr;
+}
+#else
+bool MappedFile::open(const std::string& path)
+{
+    close();
+
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    // The mapping stays valid once the file is closed.
+    struct stat info{};
+    void*       data = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size > 0)
+    {
+        data = mmap(
+            nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    ::close(fd);
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+
+    m_data = static_cast<const uint8_t*>(data);
+    m_size = size_t(info.st_size);
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (m_data)
+    {
+        munmap(const_cast<uint8_t*>(m_data), m_size);
+    }
+    m_data = nullptr;
+    m_size = 0;
+}
+#endif
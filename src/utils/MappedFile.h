@@ -0,0 +1,32 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// A read only memory mapping of a whole file. The pages are loaded by the OS
+// when they are first read.
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    ~MappedFile();
+    MappedFile(const MappedFile&)            = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    MappedFile(MappedFile&& other) noexcept;
+    MappedFile& operator=(MappedFile&& other) noexcept;
+
+    // Returns false when the file can't be mapped.
+    bool open(const std::string& path);
+    void close();
+
+    const uint8_t* getData() const { return m_data; }
+    size_t         getSize() const { return m_size; }
+
+private:
+    const uint8_t* m_data = nullptr;
+    size_t         m_size = 0;
+#if defined(_WIN32)
+    void* m_file    = nullptr;
+    void* m_mapping = nullptr;
+#endif
+};